@@ -0,0 +1,62 @@
+#ifndef _ACCELERATOR_H_
+#define _ACCELERATOR_H_
+
+#include "Geometry.h"
+#include "Container.h"
+
+// One hit of a ray. t is the ray parameter of the hit from the ray origin, u and v
+// are its barycentric coordinates on the triangle. The ids are the input indices.
+struct HitRecord
+{
+	int		rayId;
+	int		triId;
+	Scalar	t;
+	Scalar	u;
+	Scalar	v;
+};
+
+// Hits are ordered along the ray, the triangle id breaks the ties.
+inline bool operator < (const HitRecord& lhs, const HitRecord& rhs)
+{
+	return (lhs.t < rhs.t) || (lhs.t == rhs.t && lhs.triId < rhs.triId);
+}
+
+// Order of the output, by ray id then along the ray.
+inline bool HitOutputOrder(const HitRecord& lhs, const HitRecord& rhs)
+{
+	return (lhs.rayId < rhs.rayId) || (lhs.rayId == rhs.rayId && lhs < rhs);
+}
+
+// Container for the hit records. Every thread fills its own one, the records
+// are then placed by ray id into the output.
+typedef ArenaList<HitRecord> HitList;
+
+// Common interface of the ray-triangle acceleration structures.
+struct Accelerator
+{
+public:
+	virtual ~Accelerator() {}
+
+	// Build the structure over the triangles. The triangle boxes must be calculated,
+	// and triBoxAll must contain all of them.
+	virtual bool Initialize(Triangle* triangles, int num, const Box& triBoxAll) = 0;
+
+	// Find all the hits of the ray with the triangles.
+	virtual void IntersectRay(const Ray& ray, HitList& hitRecords) const = 0;
+
+	// Find all the hits of consecutive rays, one by one unless the
+	// structure can do better.
+	virtual void IntersectRays(const Ray* rays, int num, HitList& hitRecords) const
+	{
+		for (int i = 0; i < num; ++i)
+			IntersectRay(rays[i], hitRecords);
+	}
+};
+
+// Add one hit to the output container.
+inline void AddHitRecord(const HitRecord& hit, HitList& hitRecords)
+{
+	hitRecords.push_back(hit);
+}
+
+#endif
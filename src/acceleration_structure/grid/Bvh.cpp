@@ -0,0 +1,228 @@
+#include "Common.h"
+#include "Bvh.h"
+#include <assert.h>
+
+int Bvh::MAX_LEAF_SIZE = 4;
+
+Bvh::Bvh()
+{
+	Triangles = NULL;
+	BvhTriangles = NULL;
+	TriangleNumber = 0;
+	BvhRecords = NULL;
+}
+
+bool Bvh::Initialize(Triangle* triangles, int num, const Box& /*triBoxAll*/)
+{
+	Triangles = triangles;
+	TriangleNumber = num;
+	BvhTriangles = new Triangle*[num];
+
+	// The centroids of the triangle boxes are binned and partitioned together with the triangles.
+	F3d* centroids = new F3d[num];
+	for (int i = 0; i < num; ++i)
+	{
+		BvhTriangles[i] = &triangles[i];
+		centroids[i] = 0.5f * (triangles[i].box.MinCorner + triangles[i].box.MaxCorner);
+	}
+
+	Nodes.clear();
+	Nodes.reserve(2 * (num / MAX_LEAF_SIZE + 1));
+	if (num > 0)
+		BuildNode(centroids, 0, num, 0);
+
+	delete [] centroids;
+
+	BvhRecords = new TriangleRecord[num];
+	for (int i = 0; i < num; ++i)
+		BvhRecords[i].Prepare(*(BvhTriangles[i]));
+
+	return true;
+}
+
+int Bvh::BuildNode(F3d* centroids, int start, int end, int depth)
+{
+	int nodeIndex = int(Nodes.size());
+	Nodes.push_back(BvhNode());
+
+	// Bounding box of the triangles and of their centroids.
+	Box box;
+	Box centroidBox;
+	for (int i = start; i < end; ++i)
+	{
+		box.Extent(BvhTriangles[i]->box);
+		centroidBox.Extent(centroids[i]);
+	}
+	Nodes[nodeIndex].box = box;
+
+	// Split along the longest axis of the centroid box.
+	F3d diagonal = centroidBox.MaxCorner - centroidBox.MinCorner;
+	int axis = 0;
+	if (diagonal.y > diagonal[axis])
+		axis = 1;
+	if (diagonal.z > diagonal[axis])
+		axis = 2;
+
+	int mid = -1;
+	if (end - start > MAX_LEAF_SIZE && depth < MAX_DEPTH && diagonal[axis] > 0.0f)
+		mid = FindSplit(centroids, start, end, centroidBox, axis);
+
+	if (mid < 0)
+	{
+		// Leaf.
+		Nodes[nodeIndex].offset = start;
+		Nodes[nodeIndex].count = end - start;
+		Nodes[nodeIndex].axis = 0;
+		return nodeIndex;
+	}
+
+	// Inner node. The first child is created right after this node.
+	BuildNode(centroids, start, mid, depth + 1);
+	int secondIndex = BuildNode(centroids, mid, end, depth + 1);
+
+	Nodes[nodeIndex].offset = secondIndex;
+	Nodes[nodeIndex].count = 0;
+	Nodes[nodeIndex].axis = axis;
+
+	return nodeIndex;
+}
+
+int Bvh::FindSplit(F3d* centroids, int start, int end, const Box& centroidBox, int axis)
+{
+	// Put the centroids into bins.
+	Box binBoxes[BIN_NUMBER];
+	int binCounts[BIN_NUMBER] = {0};
+
+	F3d minCorner = centroidBox.MinCorner;
+	F3d maxCorner = centroidBox.MaxCorner;
+	Scalar scale = BIN_NUMBER * (1.0f - EPSILON) / (maxCorner[axis] - minCorner[axis]);
+	for (int i = start; i < end; ++i)
+	{
+		int bin = int((centroids[i][axis] - minCorner[axis]) * scale);
+		if (bin >= BIN_NUMBER)
+			bin = BIN_NUMBER - 1;
+		binBoxes[bin].Extent(BvhTriangles[i]->box);
+		binCounts[bin]++;
+	}
+
+	// Sweep from the right, get the area and the triangle count right of each bin border.
+	Scalar rightArea[BIN_NUMBER];
+	int rightCount[BIN_NUMBER];
+	Box rightBox;
+	int count = 0;
+	for (int i = BIN_NUMBER - 1; i > 0; --i)
+	{
+		rightBox.Extent(binBoxes[i]);
+		count += binCounts[i];
+		rightArea[i] = rightBox.HalfArea();
+		rightCount[i] = count;
+	}
+
+	// Sweep from the left, evaluate SAH at each bin border.
+	int bestBin = -1;
+	Scalar bestCost = INFINITE_VALUE;
+	Box leftBox;
+	count = 0;
+	for (int i = 1; i < BIN_NUMBER; ++i)
+	{
+		leftBox.Extent(binBoxes[i - 1]);
+		count += binCounts[i - 1];
+		if (count == 0 || rightCount[i] == 0)
+			continue;
+
+		Scalar cost = leftBox.HalfArea() * count + rightArea[i] * rightCount[i];
+		if (cost < bestCost)
+		{
+			bestCost = cost;
+			bestBin = i;
+		}
+	}
+
+	if (bestBin < 0)
+		return -1;
+
+	// Partition the triangles, the ones in bins left of the border come first.
+	int i = start;
+	int j = end - 1;
+	while (i <= j)
+	{
+		int bin = int((centroids[i][axis] - minCorner[axis]) * scale);
+		if (bin < bestBin)
+		{
+			++i;
+		}
+		else
+		{
+			Triangle* tri = BvhTriangles[i];
+			BvhTriangles[i] = BvhTriangles[j];
+			BvhTriangles[j] = tri;
+
+			F3d c = centroids[i];
+			centroids[i] = centroids[j];
+			centroids[j] = c;
+			--j;
+		}
+	}
+
+	assert(i > start && i < end);
+
+	return i;
+}
+
+void Bvh::IntersectRay(const Ray& ray, HitList& hitRecords) const
+{
+	if (ray.sign[0] == 0 && ray.sign[1] == 0 && ray.sign[2] == 0)
+		return;
+
+	if (Nodes.empty())
+		return;
+
+	// Depth first traversal, the near child is visited first.
+	int stack[MAX_DEPTH + 1];
+	int top = 0;
+	stack[top++] = 0;
+
+	Scalar tIn;
+	Scalar t, u, v;
+	while (top > 0)
+	{
+		int nodeIndex = stack[--top];
+		const BvhNode& node = Nodes[nodeIndex];
+
+		if (!rayBoxIntersect(ray, node.box, tIn))
+			continue;
+
+		if (node.count > 0)
+		{
+			for (int i = node.offset; i < node.offset + node.count; ++i)
+			{
+				if (rayTriangleHit(ray.origin, ray.direction, INFINITE_VALUE, BvhRecords[i], t, u, v))
+				{
+					HitRecord hit = {ray.id, int(BvhTriangles[i] - Triangles), t, u, v};
+					AddHitRecord(hit, hitRecords);
+				}
+			}
+		}
+		else
+		{
+			assert(top + 2 <= MAX_DEPTH + 1);
+
+			if (ray.sign[node.axis] < 0)
+			{
+				stack[top++] = nodeIndex + 1;
+				stack[top++] = node.offset;
+			}
+			else
+			{
+				stack[top++] = node.offset;
+				stack[top++] = nodeIndex + 1;
+			}
+		}
+	}
+}
+
+Bvh::~Bvh()
+{
+	delete [] BvhTriangles;
+	delete [] BvhRecords;
+}
@@ -0,0 +1,65 @@
+#ifndef _BVH_H_
+#define _BVH_H_
+
+#include "Geometry.h"
+#include "Container.h"
+#include "Accelerator.h"
+
+struct BvhNode
+{
+	Box		box;
+
+	// Inner node: index of the second child, the first child follows the node directly.
+	// Leaf: offset of the first triangle in BvhTriangles.
+	int		offset;
+
+	// Triangle count of the leaf, 0 for inner nodes.
+	int		count;
+
+	// Split axis of the inner node.
+	int		axis;
+};
+
+// Bounding volume hierarchy built with the binned surface area heuristic.
+struct Bvh : public Accelerator
+{
+public:
+	// Nodes, the root is the first one.
+	List<BvhNode>		Nodes;
+
+	// Input triangles, the triangle ids index this array.
+	Triangle*			Triangles;
+
+	// Triangles referenced by the leaves.
+	Triangle**			BvhTriangles;
+	int					TriangleNumber;
+
+	// Intersection records in the same order as BvhTriangles.
+	TriangleRecord*		BvhRecords;
+
+public:
+	// Leaves with no more triangles are not split.
+	static int			MAX_LEAF_SIZE;
+
+	// Bin count of the SAH split search.
+	static const int	BIN_NUMBER = 16;
+
+	// Depth limit, keeps the traversal stack bounded.
+	static const int	MAX_DEPTH = 64;
+
+public:
+	Bvh();
+
+	~Bvh();
+
+public:
+	bool Initialize(Triangle* triangles, int num, const Box& triBoxAll);
+
+	int BuildNode(F3d* centroids, int start, int end, int depth);
+
+	int FindSplit(F3d* centroids, int start, int end, const Box& centroidBox, int axis);
+
+	void IntersectRay(const Ray& ray, HitList& hitRecords) const;
+};
+
+#endif
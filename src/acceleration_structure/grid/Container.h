@@ -10,4 +10,85 @@ class List : public std::vector<T> {};
 template <class T>
 class TBB_List : public tbb::concurrent_vector<T> {};
 
+// Append-only list stored in blocks of 2^BLOCK_SHIFT elements. The elements never move
+// as the list grows, and all the blocks are released together.
+template <class T, int BLOCK_SHIFT = 14>
+class ArenaList
+{
+public:
+	static const int BLOCK_SIZE = 1 << BLOCK_SHIFT;
+
+	ArenaList()
+		: mSize(0)
+	{
+	}
+
+	ArenaList(const ArenaList& rhs)
+		: mSize(0)
+	{
+		for (size_t i = 0; i < rhs.size(); ++i)
+			push_back(rhs[i]);
+	}
+
+	~ArenaList()
+	{
+		clear();
+	}
+
+	void push_back(const T& value)
+	{
+		if ((mSize & (BLOCK_SIZE - 1)) == 0 && (mSize >> BLOCK_SHIFT) == mBlocks.size())
+			mBlocks.push_back(new T[BLOCK_SIZE]);
+		mBlocks[mSize >> BLOCK_SHIFT][mSize & (BLOCK_SIZE - 1)] = value;
+		++mSize;
+	}
+
+	T& operator [] (size_t index)
+	{
+		return mBlocks[index >> BLOCK_SHIFT][index & (BLOCK_SIZE - 1)];
+	}
+
+	const T& operator [] (size_t index) const
+	{
+		return mBlocks[index >> BLOCK_SHIFT][index & (BLOCK_SIZE - 1)];
+	}
+
+	size_t size() const
+	{
+		return mSize;
+	}
+
+	bool empty() const
+	{
+		return mSize == 0;
+	}
+
+	// Bytes held by the blocks.
+	size_t capacity_bytes() const
+	{
+		return mBlocks.size() * BLOCK_SIZE * sizeof(T);
+	}
+
+	// Empty the list, the blocks are kept for the next elements.
+	void reset()
+	{
+		mSize = 0;
+	}
+
+	// Release all the blocks.
+	void clear()
+	{
+		for (size_t i = 0; i < mBlocks.size(); ++i)
+			delete [] mBlocks[i];
+		mBlocks.clear();
+		mSize = 0;
+	}
+
+private:
+	ArenaList& operator = (const ArenaList&);
+
+	std::vector<T*>	mBlocks;
+	size_t			mSize;
+};
+
 #endif
\ No newline at end of file
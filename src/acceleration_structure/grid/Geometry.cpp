@@ -8,28 +8,30 @@
 int n;
 #endif
 
-bool rayTriangleIntersect(const F3d& o, const F3d& d, Scalar len,
-						  const Triangle& triangle,
-						  F3d& intPt)
+// The edges come from the record, the segment [o, o + len * d] bounds the hit.
+// t is the ray parameter of the hit, u and v its barycentric coordinates.
+bool rayTriangleHit(const F3d& o, const F3d& d, Scalar len,
+					const TriangleRecord& record,
+					Scalar& t, Scalar& u, Scalar& v)
 {
-	F3d e1 = triangle.p1 - triangle.p0;
-	F3d e2 = triangle.p2 - triangle.p0;
+	const F3d& e1 = record.e1;
+	const F3d& e2 = record.e2;
 
 	F3d p = Cross(d, e2);
 	Scalar det = Dot(e1, p);
 	if (det < -EPSILON)
 	{
-		F3d s = o - triangle.p0;
-		Scalar u = Dot(s, p);
+		F3d s = o - record.p0;
+		u = Dot(s, p);
 		if (u > 0.0f || u < det)
 			return false;
 
 		F3d q = Cross(s, e1);
-		Scalar v = Dot(d, q);
+		v = Dot(d, q);
 		if (v > 0.0f || u + v < det)
 			return false;
 
-		Scalar t = Dot(e2, q);
+		t = Dot(e2, q);
 		if (t > 0.0f || t < len * det)		
 			return false;
 
@@ -49,23 +51,21 @@ bool rayTriangleIntersect(const F3d& o, const F3d& d, Scalar len,
 		v *= invD;
 		t *= invD;
 
-		intPt = o + t * d;
-
 		return true;
 	}
 	else if (det > EPSILON)
 	{
-		F3d s = o - triangle.p0;
-		Scalar u = Dot(s, p);
+		F3d s = o - record.p0;
+		u = Dot(s, p);
 		if (u < 0.0f || u > det)
 			return false;
 
 		F3d q = Cross(s, e1);
-		Scalar v = Dot(d, q);
+		v = Dot(d, q);
 		if (v < 0.0f || u + v > det)
 			return false;
 
-		Scalar t = Dot(e2, q);
+		t = Dot(e2, q);
 		if (t < 0.0f || t > len * det)
 			return false;
 
@@ -85,42 +85,121 @@ bool rayTriangleIntersect(const F3d& o, const F3d& d, Scalar len,
 		v *= invD;
 		t *= invD;
 
-		intPt = o + t * d;
-
 		return true;
 	}
 
 	return false;
 }
 
-bool rayTriangleIntersect(const F3d& o, const F3d& d,
-						  const Triangle& triangle,
-						  F3d& intPt)
+// The determinant is the one of rayTriangleHit, it doesn't depend on the origin. The other
+// terms are computed in double, and each one is given the largest change that moving the
+// origin by error, or the rounding of rayTriangleHit, can make to it.
+bool rayTriangleSpan(const F3d& o, const F3d& d, Scalar tOrigin,
+					 const TriangleRecord& record, Scalar error,
+					 Scalar& tLow, Scalar& tHigh)
 {
-	F3d e1 = triangle.p1 - triangle.p0;
-	F3d e2 = triangle.p2 - triangle.p0;
+	const F3d& e1 = record.e1;
+	const F3d& e2 = record.e2;
 
 	F3d p = Cross(d, e2);
 	Scalar det = Dot(e1, p);
-	if (det > -EPSILON && det < EPSILON)
+	if (det >= -EPSILON && det <= EPSILON)
 		return false;
-	Scalar invD = 1.0f / det;
 
-	F3d s = o - triangle.p0;
-	Scalar u = invD * Dot(s, p);
-	if (u < 0.0 || u > 1.0)
+	// Flip the terms with det, so the bounds are the ones of a positive det.
+	double sign = (det < 0.0f) ? -1.0 : 1.0;
+	double absDet = sign * det;
+
+	double s[3], q[3];
+	for (int k = 0; k < 3; ++k)
+		s[k] = double(o[k]) - double(record.p0[k]);
+	q[0] = s[1] * e1.z - s[2] * e1.y;
+	q[1] = s[2] * e1.x - s[0] * e1.z;
+	q[2] = s[0] * e1.y - s[1] * e1.x;
+
+	double u = sign * (s[0] * p.x + s[1] * p.y + s[2] * p.z);
+	double v = sign * (d.x * q[0] + d.y * q[1] + d.z * q[2]);
+	double t = sign * (e2.x * q[0] + e2.y * q[1] + e2.z * q[2]);
+
+	double normD = fabs(d.x) + fabs(d.y) + fabs(d.z);
+	double normE1 = fabs(e1.x) + fabs(e1.y) + fabs(e1.z);
+	double normE2 = fabs(e2.x) + fabs(e2.y) + fabs(e2.z);
+	double errorU = 2.0 * error * normD * normE2;
+	double errorV = 2.0 * error * normD * normE1;
+	double errorT = 2.0 * error * normE1 * normE2;
+
+	if (u < -errorU || u > absDet + errorU)
 		return false;
-
-	F3d q = Cross(s, e1);
-	Scalar v = invD * Dot(d, q);
-	if (v < 0.0 || u + v > 1.0)
+	if (v < -errorV || u + v > absDet + errorU + errorV)
 		return false;
 
-	Scalar t = invD * Dot(e2, q);
-	if (t < 0.0)
+	// Widened by more than the rounding to float.
+	double tHit = tOrigin + t / absDet;
+	double tError = errorT / absDet + 1.0e-6 * fabs(tHit);
+	tLow = Scalar(tHit - tError);
+	tHigh = Scalar(tHit + tError);
+	return true;
+}
+
+// Project the triangle and the box on the axis, false if the projections are disjoint.
+inline bool overlapOnAxis(const F3d& axis, const F3d& v0, const F3d& v1, const F3d& v2, const F3d& halfSize)
+{
+	Scalar p0 = Dot(axis, v0);
+	Scalar p1 = Dot(axis, v1);
+	Scalar p2 = Dot(axis, v2);
+
+	Scalar minP = p0;
+	Scalar maxP = p0;
+	if (p1 < minP) minP = p1;
+	if (p1 > maxP) maxP = p1;
+	if (p2 < minP) minP = p2;
+	if (p2 > maxP) maxP = p2;
+
+	Scalar r = halfSize.x * fabs(axis.x) + halfSize.y * fabs(axis.y) + halfSize.z * fabs(axis.z);
+
+	return !(minP > r || maxP < -r);
+}
+
+// Separating axis test of Akenine-Moller, the box is centered at the origin.
+bool triangleBoxOverlap(const Triangle& triangle, const Box& box)
+{
+	F3d center = 0.5f * (box.MinCorner + box.MaxCorner);
+	F3d halfSize = 0.5f * (box.MaxCorner - box.MinCorner);
+
+	F3d v0 = triangle.p0 - center;
+	F3d v1 = triangle.p1 - center;
+	F3d v2 = triangle.p2 - center;
+
+	// Box face normals.
+	for (int i = 0; i < 3; ++i)
+	{
+		Scalar minV = v0[i];
+		Scalar maxV = v0[i];
+		if (v1[i] < minV) minV = v1[i];
+		if (v1[i] > maxV) maxV = v1[i];
+		if (v2[i] < minV) minV = v2[i];
+		if (v2[i] > maxV) maxV = v2[i];
+		if (minV > halfSize[i] || maxV < -halfSize[i])
+			return false;
+	}
+
+	// Cross products of the triangle edges and the box axes.
+	F3d edges[3] = {v1 - v0, v2 - v1, v0 - v2};
+	for (int i = 0; i < 3; ++i)
+	{
+		const F3d& e = edges[i];
+		if (!overlapOnAxis(F3d(0.0f, -e.z, e.y), v0, v1, v2, halfSize) ||
+			!overlapOnAxis(F3d(e.z, 0.0f, -e.x), v0, v1, v2, halfSize) ||
+			!overlapOnAxis(F3d(-e.y, e.x, 0.0f), v0, v1, v2, halfSize))
+			return false;
+	}
+
+	// Triangle normal.
+	F3d normal = Cross(edges[0], edges[1]);
+	Scalar d = Dot(normal, v0);
+	Scalar r = halfSize.x * fabs(normal.x) + halfSize.y * fabs(normal.y) + halfSize.z * fabs(normal.z);
+	if (d > r || d < -r)
 		return false;
-	
-	intPt = o + t * d;
 
 	return true;
 }
@@ -215,4 +294,58 @@ bool rayBoxIntersect(const Ray& ray, const Box& box, Scalar& tIn)
 
 	tIn = tNear;
 	return true;
-}
\ No newline at end of file
+}
+
+void rayPreCompute(Ray& ray)
+{
+	for (int i = 0; i < 3; ++i)
+	{
+		if (fabs(ray.direction[i]) < EPSILON)
+		{
+			ray.sign[i] = 0;
+		}
+		else
+		{
+			ray.invDirection[i] = 1.0f / ray.direction[i];
+			ray.sign[i] = (ray.direction[i] > 0) ? 1 : -1;
+		}
+	}
+}
+
+// Spread the 9 low bits, two zero bits between each.
+inline unsigned int expandBits(unsigned int x)
+{
+	x = (x | (x << 16)) & 0x030000FF;
+	x = (x | (x << 8)) & 0x0300F00F;
+	x = (x | (x << 4)) & 0x030C30C3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+unsigned int rayOrderKey(const Ray& ray, const Box& box)
+{
+	Scalar tIn;
+	if (!rayBoxIntersect(ray, box, tIn))
+		return 0xFFFFFFFF;
+	if (tIn < 0.0f)
+		tIn = 0.0f;
+
+	F3d p = ray.origin + tIn * ray.direction;
+	F3d size = box.MaxCorner - box.MinCorner;
+	unsigned int morton = 0;
+	for (int i = 0; i < 3; ++i)
+	{
+		int cell = 0;
+		if (size[i] > 0.0f)
+			cell = int((p[i] - box.MinCorner[i]) / size[i] * 512.0f);
+		if (cell < 0)
+			cell = 0;
+		if (cell > 511)
+			cell = 511;
+		morton |= expandBits(cell) << (2 - i);
+	}
+
+	unsigned int octant = (ray.direction.x < 0.0f ? 4 : 0) | (ray.direction.y < 0.0f ? 2 : 0) | (ray.direction.z < 0.0f ? 1 : 0);
+
+	return (octant << 27) | morton;
+}
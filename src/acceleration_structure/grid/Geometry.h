@@ -29,6 +29,11 @@ struct F3d
 	{
 		return *((Scalar*)this + index);
 	}
+
+	Scalar operator [] (int index) const
+	{
+		return *((const Scalar*)this + index);
+	}
 };
 
 inline F3d operator + (const F3d& v0, const F3d& v1)
@@ -87,6 +92,12 @@ struct Box
 			(point.x <= MaxCorner.x) && (point.y <= MaxCorner.y) && (point.z <= MaxCorner.z));
 	}
 
+	Scalar HalfArea() const
+	{
+		F3d d = MaxCorner - MinCorner;
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+
 	void Extent(const F3d& point)
 	{
 		if (point.x < MinCorner.x)
@@ -144,6 +155,17 @@ struct BasicRay {
 	F3d direction;
 };
 
+// Records of the binary output, after the hit count, with or without the ids.
+struct BasicHit {
+	F3d point;
+};
+
+struct BasicHitWithId {
+	unsigned int rayId;
+	int triId;
+	F3d point;
+};
+
 struct Triangle
 {
 	F3d		p0, p1, p2;
@@ -158,6 +180,39 @@ struct Triangle
 	}
 };
 
+// Triangle prepared for intersection, the edges are calculated once at build time.
+struct TriangleRecord
+{
+	F3d		p0;
+	F3d		e1;
+	F3d		e2;
+
+	void Prepare(const Triangle& triangle)
+	{
+		p0 = triangle.p0;
+		e1 = triangle.p1 - triangle.p0;
+		e2 = triangle.p2 - triangle.p0;
+	}
+};
+
+// Lanes of a triangle block.
+const int BLOCK_SIZE = 4;
+
+// BLOCK_SIZE triangle records stored coordinate by coordinate, so the lanes can be streamed.
+// Unused lanes hold degenerate triangles and an id of -1.
+struct TriangleBlock
+{
+	Scalar	p0[3][BLOCK_SIZE];
+	Scalar	e1[3][BLOCK_SIZE];
+	Scalar	e2[3][BLOCK_SIZE];
+
+	// Index of the triangle in the input array.
+	int		id[BLOCK_SIZE];
+
+	// Up to three cache lines, so every block of a cache aligned array starts on a line.
+	int		pad[8];
+};
+
 struct Ray
 {
 	F3d		origin;
@@ -165,18 +220,33 @@ struct Ray
 	F3d		invDirection;
 
 	int		sign[3];
-	Scalar	dt[3];
+
+	// Index of the ray in the input, the rays may be traced in another order.
+	int		id;
 };
 
-bool rayTriangleIntersect(const F3d& o, const F3d& d, Scalar len,
-						  const Triangle& triangle,
-						  F3d& intPt);
+bool rayTriangleHit(const F3d& o, const F3d& d, Scalar len,
+					const TriangleRecord& record,
+					Scalar& t, Scalar& u, Scalar& v);
 
-bool rayTriangleIntersect(const F3d& o, const F3d& d,
-						  const Triangle& triangle,
-						  F3d& intPt);
+// Range of the ray parameter where rayTriangleHit may hit the triangle, when it is called
+// from any point of the ray off by at most error along each axis, tOrigin being the parameter
+// of o. False if it can hit the triangle from none of them.
+bool rayTriangleSpan(const F3d& o, const F3d& d, Scalar tOrigin,
+					 const TriangleRecord& record, Scalar error,
+					 Scalar& tLow, Scalar& tHigh);
 
 bool rayBoxIntersect(const Ray& ray, const Box& box, Scalar& tIn);
 
+// Sign and inverse of the direction along each axis, the sign is 0 along the axes
+// the ray is parallel to.
+void rayPreCompute(Ray& ray);
+
+// Sort key of the ray, the direction octant then the Morton code of the point where
+// the ray enters the box, on a lattice of 512^3 cells. Rays missing the box come last.
+unsigned int rayOrderKey(const Ray& ray, const Box& box);
+
+bool triangleBoxOverlap(const Triangle& triangle, const Box& box);
+
 
 #endif
\ No newline at end of file
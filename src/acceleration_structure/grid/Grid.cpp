@@ -1,12 +1,48 @@
 #include "Common.h"
 #include "Grid.h"
 #include "Tools.h"
+#include "ParallelTask.h"
+#include "SimdKernel.h"
 #include <assert.h>
 #include <memory.h>
 
+// tbb includes
+#include "cache_aligned_allocator.h"
+#include "tick_count.h"
+#include "task_scheduler_init.h"
+
 float Grid::GRID_DENSITY = 2.0f;
 Scalar Grid::EXPAND_INCREMENT = 1.0f;
 Scalar Grid::DELTA = 1.0e-4f;
+bool Grid::TWO_LEVEL = false;
+int Grid::SUBGRID_THRESHOLD = 32;
+bool Grid::AUTO_RESOLUTION = false;
+Scalar Grid::STEP_COST = 1.0f;
+Scalar Grid::INTERSECT_COST = 1.5f;
+bool Grid::EXACT_OVERLAP = false;
+bool Grid::PACKET_TRAVERSAL = false;
+bool Grid::EMPTY_SPACE_SKIPPING = false;
+bool Grid::MAILBOXING = false;
+QueryMode Grid::QUERY = QUERY_ALL;
+int Grid::QUERY_K = 1;
+bool Grid::COLLECT_STATS = false;
+Scalar Grid::PACKET_COHERENCE = 0.9f;
+
+// Densities tried in auto resolution mode.
+static const float AUTO_DENSITIES[] = {0.5f, 1.0f, 2.0f, 4.0f, 8.0f};
+static const int AUTO_DENSITY_NUMBER = sizeof(AUTO_DENSITIES) / sizeof(AUTO_DENSITIES[0]);
+
+// Histogram bins per axis for the centroid distribution.
+static const int CENTROID_BIN_NUMBER = 256;
+
+// Blocks allocated for a compacted grid, at least one so the array always exists.
+static int allocatedBlockNumber(int blockCount)
+{
+	return (blockCount > 0) ? blockCount : 1;
+}
+
+// Cell counts the parallel categorize may hold over all its triangle ranges.
+static const int CATEGORIZE_COUNT_BUDGET = 1 << 24;
 
 #define OUT_RAY 0
 #define CHECK_TIN 0
@@ -19,6 +55,16 @@ Scalar Grid::DELTA = 1.0e-4f;
 int rayn;
 #endif
 
+inline Triangle& TriangleAt(Triangle* triangles, int n)
+{
+	return triangles[n];
+}
+
+inline Triangle& TriangleAt(Triangle** triangles, int n)
+{
+	return *(triangles[n]);
+}
+
 Grid::Grid()
 {
 	CellNumber[0] = CellNumber[1] = CellNumber[2] = 0;
@@ -29,25 +75,261 @@ Grid::Grid()
 	CoordY = NULL;
 	CoordZ = NULL;
 
+	Triangles = NULL;
+	TriangleNumber = 0;
+
 	CellOffset = NULL;
     CellTriangles = NULL;
+	CellSubGrids = NULL;
+	RemovedReferenceNumber = 0;
+
+	CellBlockOffset = NULL;
+	CellBlocks = NULL;
+
+	CellDistances = NULL;
+
+	Records = NULL;
+	OwnRecords = false;
+}
+
+// Time of a build step, from start to now. The next step starts now.
+static void addBuildPhase(List<PhaseTime>& phases, const char* name, tbb::tick_count& start)
+{
+	tbb::tick_count now = tbb::tick_count::now();
+	PhaseTime phase = {name, (now - start).seconds()};
+	phases.push_back(phase);
+	start = now;
 }
 
 bool Grid::Initialize(Triangle* triangles, int num, const Box& triBoxAll)
 {
+	Triangles = triangles;
+	TriangleNumber = num;
+
+	BuildPhases.clear();
+	tbb::tick_count start = tbb::tick_count::now();
+
+	// Edges of the triangles, read by the compact blocks and the kernels.
+	PrepareRecords();
+	addBuildPhase(BuildPhases, "records", start);
+
 	// Get the bounding box of the whole grid.
 	CreateGridBoundingBox(triBoxAll);
 
 	// SubDivide.
-	SubDivide(num);
+	if (AUTO_RESOLUTION)
+		AutoSubDivide(triangles, num);
+	else
+		SubDivide(num);
 	CalculateCoordinates();	
+	addBuildPhase(BuildPhases, "subdivide", start);
 
 	// Categorize.
+#if PARALLEL && PARALLEL_BUILD
+	CategorizeTrianglesParallel(triangles, num);
+#else
 	CategorizeTriangles(triangles, num);
+#endif
+	addBuildPhase(BuildPhases, "categorize", start);
+
+	// Nested grids for the crowded cells.
+	if (TWO_LEVEL)
+	{
+		CreateSubGrids();
+		addBuildPhase(BuildPhases, "subgrids", start);
+	}
+
+#if COMPACT_CELLS
+	CompactCells();
+	addBuildPhase(BuildPhases, "compact", start);
+#endif
+
+	if (EMPTY_SPACE_SKIPPING)
+	{
+		CreateCellDistances();
+		addBuildPhase(BuildPhases, "distances", start);
+	}
+
+	return true;
+}
+
+bool Grid::InitializeSubGrid(Triangle** triangles, int num, const Box& cellBox, Triangle* base, TriangleRecord* baseRecords)
+{
+	// The nested grid covers the cell exactly, the triangles may stick out of it.
+	Triangles = base;
+	Records = baseRecords;
+	SceneBox = cellBox;
+	GridBox = cellBox;
+
+	if (AUTO_RESOLUTION)
+		AutoSubDivide(triangles, num);
+	else
+		SubDivide(num);
+	CalculateCoordinates();
+
+	CategorizeTriangles(triangles, num);
+
+#if COMPACT_CELLS
+	CompactCells();
+#endif
+
+	if (EMPTY_SPACE_SKIPPING)
+		CreateCellDistances();
 
 	return true;
 }
 
+void Grid::CreateSubGrids()
+{
+	CellSubGrids = new Grid*[CellTotalNumber];
+	memset(CellSubGrids, 0, sizeof(Grid*) * CellTotalNumber);
+
+#if PARALLEL && PARALLEL_BUILD
+	tbb::parallel_for(tbb::blocked_range<int>(0, CellTotalNumber), SubGridTask(this));
+#else
+	for (int i = 0; i < CellTotalNumber; ++i)
+		CreateSubGrid(i);
+#endif
+}
+
+void Grid::CreateSubGrid(int index)
+{
+	int count = CellOffset[index + 1] - CellOffset[index];
+	if (count <= SUBGRID_THRESHOLD)
+		return;
+
+	int k = index % CellNumber[0];
+	int j = (index / CellNumber[0]) % CellNumber[1];
+	int i = index / (CellNumber[0] * CellNumber[1]);
+
+	Box cellBox;
+	cellBox.MinCorner = F3d(CoordX[k], CoordY[j], CoordZ[i]);
+	cellBox.MaxCorner = F3d(CoordX[k + 1], CoordY[j + 1], CoordZ[i + 1]);
+
+	CellSubGrids[index] = new Grid;
+	CellSubGrids[index]->InitializeSubGrid(&CellTriangles[CellOffset[index]], count, cellBox, Triangles, Records);
+}
+
+void Grid::PrepareRecords()
+{
+	Records = new TriangleRecord[TriangleNumber];
+	OwnRecords = true;
+
+#if PARALLEL && PARALLEL_BUILD
+	tbb::parallel_for(tbb::blocked_range<int>(0, TriangleNumber), PrepareRecordTask(this));
+#else
+	for (int n = 0; n < TriangleNumber; ++n)
+		Records[n].Prepare(Triangles[n]);
+#endif
+}
+
+void Grid::CompactCells()
+{
+	// Block offsets, a partly filled block ends each cell.
+	CellBlockOffset = new int[CellTotalNumber + 1];
+	CellBlockOffset[0] = 0;
+	for (int i = 0; i < CellTotalNumber; ++i)
+	{
+		int count = CellOffset[i + 1] - CellOffset[i];
+		if (CellSubGrids != NULL && CellSubGrids[i] != NULL)
+			count = 0;
+		CellBlockOffset[i + 1] = CellBlockOffset[i] + (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	}
+
+	int blockCount = CellBlockOffset[CellTotalNumber];
+	CellBlocks = tbb::cache_aligned_allocator<TriangleBlock>().allocate(allocatedBlockNumber(blockCount));
+
+#if PARALLEL && PARALLEL_BUILD
+	tbb::parallel_for(tbb::blocked_range<int>(0, CellTotalNumber), CompactCellTask(this));
+#else
+	for (int i = 0; i < CellTotalNumber; ++i)
+		CompactCell(i);
+#endif
+}
+
+void Grid::CompactCell(int index)
+{
+	TriangleBlock* blocks = CellBlocks + CellBlockOffset[index];
+	int blockCount = CellBlockOffset[index + 1] - CellBlockOffset[index];
+	if (blockCount == 0)
+		return;
+
+	memset(blocks, 0, sizeof(TriangleBlock) * blockCount);
+
+	int count = CellOffset[index + 1] - CellOffset[index];
+	for (int i = 0; i < blockCount * BLOCK_SIZE; ++i)
+	{
+		TriangleBlock& block = blocks[i / BLOCK_SIZE];
+		int lane = i % BLOCK_SIZE;
+		if (i >= count)
+		{
+			block.id[lane] = -1;
+			continue;
+		}
+
+		int id = int(CellTriangles[CellOffset[index] + i] - Triangles);
+		const TriangleRecord& record = Records[id];
+		for (int k = 0; k < 3; ++k)
+		{
+			block.p0[k][lane] = record.p0[k];
+			block.e1[k][lane] = record.e1[k];
+			block.e2[k][lane] = record.e2[k];
+		}
+		block.id[lane] = id;
+	}
+}
+
+void Grid::CreateCellDistances()
+{
+	CellDistances = new unsigned char[CellTotalNumber];
+
+	// Breadth first search from the occupied cells over the 26 neighbors, the level of
+	// a cell is its Chebyshev distance. 255 marks the cells not reached yet.
+	List<int> front;
+	for (int i = 0; i < CellTotalNumber; ++i)
+	{
+		bool occupied = (CellOffset[i + 1] > CellOffset[i]) || (CellSubGrids != NULL && CellSubGrids[i] != NULL);
+		CellDistances[i] = occupied ? 0 : 255;
+		if (occupied)
+			front.push_back(i);
+	}
+
+	List<int> next;
+	for (int distance = 1; distance < 255 && !front.empty(); ++distance)
+	{
+		next.clear();
+		for (size_t k = 0; k < front.size(); ++k)
+		{
+			int index = front[k];
+			int x = index % CellNumber[0];
+			int y = index / CellNumber[0] % CellNumber[1];
+			int z = index / (CellNumber[0] * CellNumber[1]);
+			for (int nz = z - 1; nz <= z + 1; ++nz)
+			{
+				if (nz < 0 || nz >= CellNumber[2])
+					continue;
+				for (int ny = y - 1; ny <= y + 1; ++ny)
+				{
+					if (ny < 0 || ny >= CellNumber[1])
+						continue;
+					for (int nx = x - 1; nx <= x + 1; ++nx)
+					{
+						if (nx < 0 || nx >= CellNumber[0])
+							continue;
+						int neighbor = (nz * CellNumber[1] + ny) * CellNumber[0] + nx;
+						if (CellDistances[neighbor] == 255)
+						{
+							CellDistances[neighbor] = (unsigned char)distance;
+							next.push_back(neighbor);
+						}
+					}
+				}
+			}
+		}
+		front.swap(next);
+	}
+}
+
 void Grid::CreateGridBoundingBox(const Box& triBoxAll)
 {
 	SceneBox.MinCorner = triBoxAll.MinCorner - F3d(EXPAND_INCREMENT);
@@ -60,9 +342,15 @@ void Grid::CreateGridBoundingBox(const Box& triBoxAll)
 
 void Grid::SubDivide(int num)
 {
-	int cellCount = int(num * GRID_DENSITY);
+	SubDivide(int(num * GRID_DENSITY), GridBox.MaxCorner - GridBox.MinCorner);
+}
+
+// The cells are shared among the axes in proportion to the diagonal.
+void Grid::SubDivide(int cellCount, F3d diagonal)
+{
+	if (cellCount < 1)
+		cellCount = 1;
 
-	F3d diagonal = GridBox.MaxCorner - GridBox.MinCorner;
 	int order[3] = {0, 1, 2};
  
     Scalar s = Scalar(pow(Scalar(diagonal.x * diagonal.y * diagonal.z / cellCount), Scalar(1.0 / 3.0)));
@@ -91,9 +379,105 @@ void Grid::SubDivide(int num)
     CellTotalNumber = CellNumber[0] * CellNumber[1] * CellNumber[2];	
 }
 
-void Grid::CalculateCoordinates()
+template <class TriangleArray>
+void Grid::AutoSubDivide(TriangleArray triangles, int num)
+{
+	F3d extent = GetCentroidExtent(triangles, num);
+
+	// Keep the cheapest density. The first one stands if no cost compares, they may be
+	// NaN or infinite for a degenerate extent.
+	int bestCellNumber[3] = {1, 1, 1};
+	Scalar bestCost = INFINITE_VALUE;
+	for (int i = 0; i < AUTO_DENSITY_NUMBER; ++i)
+	{
+		SubDivide(int(num * AUTO_DENSITIES[i]), extent);
+		Scalar cost = EstimateCost(triangles, num);
+		if (i == 0 || cost < bestCost)
+		{
+			bestCost = cost;
+			bestCellNumber[0] = CellNumber[0];
+			bestCellNumber[1] = CellNumber[1];
+			bestCellNumber[2] = CellNumber[2];
+		}
+	}
+
+	CellNumber[0] = bestCellNumber[0];
+	CellNumber[1] = bestCellNumber[1];
+	CellNumber[2] = bestCellNumber[2];
+	CellTotalNumber = CellNumber[0] * CellNumber[1] * CellNumber[2];
+}
+
+// The grid box extent without the slabs that hold no triangle centroid.
+template <class TriangleArray>
+F3d Grid::GetCentroidExtent(TriangleArray triangles, int num) const
+{
+	F3d diagonal = GridBox.MaxCorner - GridBox.MinCorner;
+
+	bool* occupied = new bool[3 * CENTROID_BIN_NUMBER];
+	memset(occupied, 0, sizeof(bool) * 3 * CENTROID_BIN_NUMBER);
+
+	F3d minCorner = GridBox.MinCorner;
+	for (int n = 0; n < num; ++n)
+	{
+		const Box& box = TriangleAt(triangles, n).box;
+		F3d centroid = 0.5f * (box.MinCorner + box.MaxCorner);
+		for (int i = 0; i < 3; ++i)
+		{
+			int bin = int((centroid[i] - minCorner[i]) / diagonal[i] * CENTROID_BIN_NUMBER);
+			if (bin < 0)
+				bin = 0;
+			if (bin > CENTROID_BIN_NUMBER - 1)
+				bin = CENTROID_BIN_NUMBER - 1;
+			occupied[i * CENTROID_BIN_NUMBER + bin] = true;
+		}
+	}
+
+	F3d extent;
+	for (int i = 0; i < 3; ++i)
+	{
+		int count = 0;
+		for (int j = 0; j < CENTROID_BIN_NUMBER; ++j)
+		{
+			if (occupied[i * CENTROID_BIN_NUMBER + j])
+				count++;
+		}
+		if (count < 1)
+			count = 1;
+		extent[i] = diagonal[i] * count / CENTROID_BIN_NUMBER;
+	}
+
+	delete [] occupied;
+
+	return extent;
+}
+
+// Expected cost of a random ray through the grid box with the current cell numbers.
+// A random line hits a cell with probability area(cell) / area(grid box), so the ray
+// steps CellTotalNumber and tests all the triangle references with that weight.
+template <class TriangleArray>
+Scalar Grid::EstimateCost(TriangleArray triangles, int num)
+{
+	CalculateCellSize();
+
+	double references = 0;
+	for (int n = 0; n < num; ++n)
+	{
+		int startIndex[3], endIndex[3];
+		IntersectTriangleBBox(TriangleAt(triangles, n), startIndex, endIndex);
+		references += double(endIndex[0] - startIndex[0] + 1) *
+			(endIndex[1] - startIndex[1] + 1) * (endIndex[2] - startIndex[2] + 1);
+	}
+
+	Box cellBox;
+	cellBox.MinCorner = F3d(0.0f);
+	cellBox.MaxCorner = CellSize;
+	double probability = cellBox.HalfArea() / GridBox.HalfArea();
+
+	return Scalar((STEP_COST * double(CellTotalNumber) + INTERSECT_COST * references) * probability);
+}
+
+void Grid::CalculateCellSize()
 {
-	// Get size and coordinates.
 	F3d diff = GridBox.MaxCorner - GridBox.MinCorner;
 	CellSize.x = diff.x / CellNumber[0];
 	CellSize.y = diff.y / CellNumber[1];
@@ -101,6 +485,12 @@ void Grid::CalculateCoordinates()
 	InvCellSize.x = 1.0f / CellSize.x;
 	InvCellSize.y = 1.0f / CellSize.y;
 	InvCellSize.z = 1.0f / CellSize.z;
+}
+
+void Grid::CalculateCoordinates()
+{
+	// Get size and coordinates.
+	CalculateCellSize();
 
 	CoordX = new Scalar[CellNumber[0] + 1];
 	CoordY = new Scalar[CellNumber[1] + 1];
@@ -119,7 +509,8 @@ void Grid::CalculateCoordinates()
 	CoordZ[CellNumber[2]] = GridBox.MaxCorner.z;
 }
 
-void Grid::CategorizeTriangles(Triangle* triangles, int num)
+template <class TriangleArray>
+void Grid::CategorizeTriangles(TriangleArray triangles, int num)
 {
     // Allocate offset array.
     CellOffset = new int[CellTotalNumber + 1];
@@ -129,12 +520,11 @@ void Grid::CategorizeTriangles(Triangle* triangles, int num)
     // First pass, get the triangle count for each cell, and allocate memory.    
     for (int n = 0; n < num; ++n)
 	{
-		assert(GridBox.PointInBox(triangles[n].box.MinCorner) &&
-			GridBox.PointInBox(triangles[n].box.MaxCorner));
-		
         // Check which cells overlap with the triangle bounding box.
         int startIndex[3], endIndex[3];
-        IntersectTriangleBBox(triangles[n], startIndex, endIndex);
+        IntersectTriangleBBox(TriangleAt(triangles, n), startIndex, endIndex);
+
+        bool overlapTest = NeedOverlapTest(startIndex, endIndex);
 
         // Accumulate triangle count for each cell.
     	for (int i = startIndex[2]; i <= endIndex[2]; ++i)
@@ -143,6 +533,12 @@ void Grid::CategorizeTriangles(Triangle* triangles, int num)
 	        {
 		        for (int k = startIndex[0]; k <= endIndex[0]; ++k)
 		        {
+			        if (overlapTest && !TriangleInCell(TriangleAt(triangles, n), k, j, i))
+			        {
+				        RemovedReferenceNumber++;
+				        continue;
+			        }
+
 			        int index = (CellNumber[0]*CellNumber[1])*i + CellNumber[0]*j + k;
 			        CellOffset[index]++;
 		        }
@@ -162,7 +558,8 @@ void Grid::CategorizeTriangles(Triangle* triangles, int num)
     for (int n = 0; n < num; ++n)
 	{	
         int startIndex[3], endIndex[3];
-        IntersectTriangleBBox(triangles[n], startIndex, endIndex);
+        IntersectTriangleBBox(TriangleAt(triangles, n), startIndex, endIndex);
+        bool overlapTest = NeedOverlapTest(startIndex, endIndex);
         
     	for (int i = startIndex[2]; i <= endIndex[2]; ++i)
         {
@@ -170,16 +567,78 @@ void Grid::CategorizeTriangles(Triangle* triangles, int num)
 	        {
 		        for (int k = startIndex[0]; k <= endIndex[0]; ++k)
 		        {
+			        if (overlapTest && !TriangleInCell(TriangleAt(triangles, n), k, j, i))
+				        continue;
+
 			        int index = (CellNumber[0]*CellNumber[1])*i + CellNumber[0]*j + k;
                     // Subtract the triangle count of this cell, so get the real offset.
 			        CellOffset[index]--;
-                    CellTriangles[CellOffset[index]] = &triangles[n];
+                    CellTriangles[CellOffset[index]] = &TriangleAt(triangles, n);
 		        }
 	        }
         }
     }
 }
 
+#if PARALLEL && PARALLEL_BUILD
+// Same result as CategorizeTriangles. Every range of triangles counts in its own row, and
+// fills its part of a cell from the end like the serial loop, the part after the ones of
+// the later ranges, so the order of the cells is the serial one.
+void Grid::CategorizeTrianglesParallel(Triangle* triangles, int num)
+{
+    CellOffset = new int[CellTotalNumber + 1];
+    CellOffset[0] = 0;
+
+    // One range of triangles per thread, every range counts all the cells, so there are
+    // fewer ranges when the grid is large.
+    int rangeNumber = tbb::task_scheduler_init::default_num_threads();
+    rangeNumber = std::min(rangeNumber, std::max(1, CATEGORIZE_COUNT_BUDGET / CellTotalNumber));
+    rangeNumber = std::max(1, std::min(rangeNumber, num));
+
+    int* counts = new int[(long long)rangeNumber * CellTotalNumber];
+    int* removed = new int[rangeNumber];
+
+    // First pass, count.
+    tbb::parallel_for(tbb::blocked_range<int>(0, rangeNumber, 1), CountCellTask(this, triangles, num, rangeNumber, counts, removed));
+    RemovedReferenceNumber = 0;
+    for (int b = 0; b < rangeNumber; ++b)
+        RemovedReferenceNumber += removed[b];
+
+    // Offsets. After this, CellOffset[i + 1] is the offset of next cell, and the counts
+    // are the cursors of the ranges.
+    ScanCellTask scanTask(counts, rangeNumber, CellTotalNumber, CellOffset);
+    tbb::parallel_scan(tbb::blocked_range<int>(0, CellTotalNumber), scanTask);
+
+    int totalTriangleCount = CellOffset[CellTotalNumber];
+    CellTriangles = new Triangle*[totalTriangleCount];
+
+    // Second pass, scatter. Every range fills its part of the cells from the end.
+    tbb::parallel_for(tbb::blocked_range<int>(0, rangeNumber, 1), ScatterCellTask(this, triangles, num, rangeNumber, counts));
+
+    delete [] removed;
+    delete [] counts;
+}
+#endif
+
+// The overlap test only pays when the bounding box spans several cells.
+bool Grid::NeedOverlapTest(const int startIndex[], const int endIndex[]) const
+{
+	return EXACT_OVERLAP && ((startIndex[0] != endIndex[0]) ||
+		(startIndex[1] != endIndex[1]) || (startIndex[2] != endIndex[2]));
+}
+
+bool Grid::TriangleInCell(const Triangle& triangle, int x, int y, int z) const
+{
+	// Grow the cell a little, so triangles on the cell border are kept on both sides.
+	F3d margin = DELTA * CellSize;
+
+	Box cellBox;
+	cellBox.MinCorner = F3d(CoordX[x], CoordY[y], CoordZ[z]) - margin;
+	cellBox.MaxCorner = F3d(CoordX[x + 1], CoordY[y + 1], CoordZ[z + 1]) + margin;
+
+	return triangleBoxOverlap(triangle, cellBox);
+}
+
 void Grid::IntersectTriangleBBox(Triangle& triangle, int startIndex[], int endIndex[])
 {
 	const F3d& start = triangle.box.MinCorner;
@@ -193,25 +652,39 @@ void Grid::IntersectTriangleBBox(Triangle& triangle, int startIndex[], int endIn
 	endIndex[1] = int((end.y - GridBox.MinCorner.y) * InvCellSize.y);
 	endIndex[2] = int((end.z - GridBox.MinCorner.z) * InvCellSize.z);
 
+	// Triangles of a nested grid may stick out of the grid box.
+	for (int i = 0; i < 3; ++i)
+	{
+		if (startIndex[i] < 0)
+			startIndex[i] = 0;
+		if (endIndex[i] > CellNumber[i] - 1)
+			endIndex[i] = CellNumber[i] - 1;
+	}
+
 	assert((startIndex[0] <= endIndex[0]) && (startIndex[1] <= endIndex[1]) && (startIndex[2] <= endIndex[2]));
 }
 
-#if PARALLEL
-#if PARSE_INSIDE
-void Grid::IntersectRay(const Ray& ray, TBB_List<char*>& intersectPoints) const
-#else
-void Grid::IntersectRay(const Ray& ray, TBB_List<F3d>& intersectPoints) const
-#endif
-#else
-void Grid::IntersectRay(const Ray& ray, List<F3d>& intersectPoints) const
-#endif
+void Grid::IntersectRay(const Ray& ray, HitList& hitRecords) const
+{
+	IntersectRay(ray, LocalStats(), hitRecords);
+}
+
+TraversalStats* Grid::LocalStats() const
+{
+	return COLLECT_STATS ? &ThreadStats.local() : NULL;
+}
+
+void Grid::IntersectRay(const Ray& ray, TraversalStats* stats, HitList& hitRecords) const
 {
+	if (stats != NULL)
+		++stats->rays;
+
 	if (ray.sign[0] == 0 && ray.sign[1] == 0 && ray.sign[2] == 0)
 		return;
 
 	// Do intersection of the ray on the scene box(rather than the grid box).
 	Scalar tIn;
-	if (!TestRayToSceneBox(ray, tIn))
+	if (!TestRayToSceneBox(ray, tIn, stats))
 		return;
 
 #if CHECK_TIN
@@ -223,18 +696,357 @@ void Grid::IntersectRay(const Ray& ray, List<F3d>& intersectPoints) const
 
 	const F3d& o = ray.origin + tIn * ray.direction;
 
-	// Find the start cell of the origin.
+	// The hits of the query are reported once the traversal ends.
+	NearestHits rayHit;
+	NearestHits* rayHits = NULL;
+	if (QUERY != QUERY_ALL)
+	{
+		rayHit.capacity = (QUERY == QUERY_FIRST_K) ? QUERY_K : 1;
+		rayHits = &rayHit;
+	}
+
+	size_t hitNumber = hitRecords.size();
+
+	Mailbox* mailbox = NULL;
+	if (MAILBOXING)
+	{
+		mailbox = &Mailboxes.local();
+		mailbox->Next(Records, TriangleNumber, OriginError(ray));
+	}
+
+	Scalar dt[3];
+	CellSteps(ray, dt);
+	IntersectRay(ray, o, tIn, INFINITE_VALUE, dt, mailbox, stats, 0, rayHits, hitRecords);
+
+	if (rayHits != NULL)
+		ReportHits(rayHit, hitRecords);
+
+	if (stats != NULL)
+		stats->hits += hitRecords.size() - hitNumber;
+}
+
+void Grid::IntersectRays(const Ray* rays, int num, HitList& hitRecords) const
+{
+	// The counters of the thread are looked up once for all the rays.
+	TraversalStats* stats = LocalStats();
+	if (!PACKET_TRAVERSAL)
+	{
+		for (int i = 0; i < num; ++i)
+			IntersectRay(rays[i], stats, hitRecords);
+		return;
+	}
+
+	// Consecutive coherent rays go as a packet, the others one by one.
+	int i = 0;
+	while (i < num)
+	{
+		int count = 1;
+		while (count < PACKET_SIZE && i + count < num && RaysCoherent(rays[i], rays[i + count]))
+			++count;
+
+		if (count > 1)
+			IntersectPacket(rays + i, count, stats, hitRecords);
+		else
+			IntersectRay(rays[i], stats, hitRecords);
+
+		i += count;
+	}
+}
+
+bool Grid::RaysCoherent(const Ray& first, const Ray& ray) const
+{
+	// Same direction octant, and directions close enough to walk the same cells.
+	if (first.sign[0] != ray.sign[0] || first.sign[1] != ray.sign[1] || first.sign[2] != ray.sign[2])
+		return false;
+
+	Scalar d = Dot(first.direction, ray.direction);
+	Scalar l = Dot(first.direction, first.direction) * Dot(ray.direction, ray.direction);
+	return d > 0.0f && d * d >= PACKET_COHERENCE * PACKET_COHERENCE * l;
+}
+
+void Grid::IntersectPacket(const Ray* rays, int count, TraversalStats* stats, HitList& hitRecords) const
+{
+	// Every ray keeps the state of its own 3DDA, the rays step together and the
+	// rays in the same cell share the cell test.
+	int c[PACKET_SIZE][3];
+	Scalar t[PACKET_SIZE][3];
+	Scalar tNear[PACKET_SIZE];
+	Scalar tLen[PACKET_SIZE];
+	Scalar tIn[PACKET_SIZE];
+	Scalar tStart[PACKET_SIZE];
+	Scalar dt[PACKET_SIZE][3];
+	F3d o[PACKET_SIZE];
+	F3d no[PACKET_SIZE];
+	int cellIndex[PACKET_SIZE];
+
+	if (stats != NULL)
+		stats->rays += count;
+	size_t hitNumber = hitRecords.size();
+
+	NearestHits packetHits[PACKET_SIZE];
+	NearestHits* rayHits = NULL;
+	if (QUERY != QUERY_ALL)
+	{
+		for (int i = 0; i < count; ++i)
+			packetHits[i].capacity = (QUERY == QUERY_FIRST_K) ? QUERY_K : 1;
+		rayHits = packetHits;
+	}
+
+	unsigned int active = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		const Ray& ray = rays[i];
+		if (ray.sign[0] == 0 && ray.sign[1] == 0 && ray.sign[2] == 0)
+			continue;
+
+		if (!TestRayToSceneBox(ray, tIn[i], stats))
+			continue;
+
+		o[i] = ray.origin + tIn[i] * ray.direction;
+		CellSteps(ray, dt[i]);
+		StartTraversal(ray, o[i], c[i], t[i]);
+		tNear[i] = 0;
+		tLen[i] = 0;
+		no[i] = o[i];
+		active |= 1u << i;
+	}
+
+	while (active != 0)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			if (!(active & (1u << i)))
+				continue;
+
+			if (!CellInGrid(c[i]) || !(tNear[i] < INFINITE_VALUE))
+			{
+				active &= ~(1u << i);
+				continue;
+			}
+
+			// Jump over the empty cells around, the ray may leave the grid.
+			if (CellDistances != NULL && CellDistance(c[i]) > 1)
+			{
+				bool inside = true;
+				while (inside && CellDistance(c[i]) > 1)
+				{
+					inside = SkipEmptyCells(rays[i], o[i], INFINITE_VALUE, c[i], t[i], tNear[i]) && CellInGrid(c[i]);
+					if (stats != NULL)
+						++stats->emptySkips;
+				}
+
+				if (!inside)
+				{
+					active &= ~(1u << i);
+					continue;
+				}
+				no[i] = o[i] + tNear[i] * rays[i].direction;
+			}
+
+			tStart[i] = tIn[i] + tNear[i];
+			cellIndex[i] = StepCell(rays[i], dt[i], INFINITE_VALUE, c[i], t[i], tNear[i], tLen[i]);
+			if (stats != NULL)
+				CountCell(cellIndex[i], stats);
+		}
+
+		// Test the cells, one group of rays per distinct cell.
+		unsigned int pending = active;
+		while (pending != 0)
+		{
+			int first = 0;
+			while (!(pending & (1u << first)))
+				++first;
+
+			unsigned int group = 0;
+			for (int i = first; i < count; ++i)
+			{
+				if ((pending & (1u << i)) && cellIndex[i] == cellIndex[first])
+					group |= 1u << i;
+			}
+			pending &= ~group;
+
+			if (CellSubGrids != NULL && CellSubGrids[cellIndex[first]] != NULL)
+			{
+				for (int i = first; i < count; ++i)
+				{
+					if (group & (1u << i))
+						IntersectSubGrid(rays[i], no[i], tStart[i], tLen[i], cellIndex[first], NULL, stats, i, rayHits, hitRecords);
+				}
+			}
+			else if (group == (1u << first))
+			{
+				IntersectCell(rays[first], no[first], tStart[first], tLen[first], cellIndex[first], NULL, stats, first, rayHits, hitRecords);
+			}
+			else
+			{
+				IntersectPacket(rays, group, no, tStart, tLen, cellIndex[first], stats, rayHits, hitRecords);
+			}
+		}
+
+		// Get next start, the rays with a final hit stop.
+		for (int i = 0; i < count; ++i)
+		{
+			if (!(active & (1u << i)))
+				continue;
+
+			no[i] = o[i] + tNear[i] * rays[i].direction;
+			if (rayHits != NULL && QueryDone(rayHits[i], tIn[i] + tNear[i]))
+				active &= ~(1u << i);
+		}
+	}
+
+	if (rayHits != NULL)
+	{
+		for (int i = 0; i < count; ++i)
+			ReportHits(rayHits[i], hitRecords);
+	}
+
+	if (stats != NULL)
+		stats->hits += hitRecords.size() - hitNumber;
+}
+
+void Grid::IntersectPacket(const Ray* rays, unsigned int group, const F3d* o, const Scalar* tOrigin, const Scalar* len, int cellIndex, TraversalStats* stats, NearestHits* rayHits, HitList& hitRecords) const
+{
+#if COMPACT_CELLS
+	PacketRays packet;
+	for (int i = 0; i < PACKET_SIZE; ++i)
+	{
+		bool inGroup = (group & (1u << i)) != 0;
+		packet.ox[i] = inGroup ? o[i].x : 0.0f;
+		packet.oy[i] = inGroup ? o[i].y : 0.0f;
+		packet.oz[i] = inGroup ? o[i].z : 0.0f;
+		packet.dx[i] = inGroup ? rays[i].direction.x : 0.0f;
+		packet.dy[i] = inGroup ? rays[i].direction.y : 0.0f;
+		packet.dz[i] = inGroup ? rays[i].direction.z : 0.0f;
+		packet.len[i] = inGroup ? len[i] : 0.0f;
+	}
+
+	// Every triangle of the cell is loaded once for the whole group.
+	KernelHits hits;
+	const TriangleBlock* block = CellBlocks + CellBlockOffset[cellIndex];
+	int count = CellOffset[cellIndex + 1] - CellOffset[cellIndex];
+	for (int i = 0; i < count; i += BLOCK_SIZE, ++block)
+	{
+		int laneCount = (count - i < BLOCK_SIZE) ? count - i : BLOCK_SIZE;
+		for (int lane = 0; lane < laneCount; ++lane)
+		{
+			if (stats != NULL)
+				stats->trianglesTested += bitCount(group);
+
+			unsigned int mask = IntersectPacketTriangle(packet, group, *block, lane, hits);
+
+			for (int r = 0; mask != 0; ++r, mask >>= 1)
+			{
+				if (mask & 1)
+					AddHit(rays[r], block->id[lane], tOrigin[r] + hits.t[r], hits.u[r], hits.v[r], rayHits, r, hitRecords);
+			}
+		}
+	}
+#else
+	for (int i = 0; i < PACKET_SIZE; ++i)
+	{
+		if (group & (1u << i))
+			IntersectCell(rays[i], o[i], tOrigin[i], len[i], cellIndex, NULL, stats, i, rayHits, hitRecords);
+	}
+#endif
+}
+
+void Grid::IntersectRay(const Ray& ray, const F3d& o, Scalar tOrigin, Scalar tEnd, const Scalar dt[3], Mailbox* mailbox, TraversalStats* stats, int slot, NearestHits* rayHits, HitList& hitRecords) const
+{
 	int c[3];
+	Scalar t[3];
+	StartTraversal(ray, o, c, t);
+
+	// 3DDA. Access the grid cells.
+	Scalar tNear = 0;
+	Scalar tLen = 0;
+	F3d no = o;
+	while (CellInGrid(c) && (tNear < tEnd))
+	{
+		// Jump over the empty cells around.
+		if (CellDistances != NULL && CellDistance(c) > 1)
+		{
+			if (stats != NULL)
+				++stats->emptySkips;
+
+			if (!SkipEmptyCells(ray, o, tEnd, c, t, tNear))
+				break;
+
+			no = o + tNear * ray.direction;
+			continue;
+		}
+
+		Scalar tStart = tOrigin + tNear;
+		int cellIndex = StepCell(ray, dt, tEnd, c, t, tNear, tLen);
+		if (stats != NULL)
+			CountCell(cellIndex, stats);
+
+		// Test current cell.
+		if (CellSubGrids != NULL && CellSubGrids[cellIndex] != NULL)
+		{
+			IntersectSubGrid(ray, no, tStart, tLen, cellIndex, mailbox, stats, slot, rayHits, hitRecords);
+		}
+		else
+		{
+			IntersectCell(ray, no, tStart, tLen, cellIndex, mailbox, stats, slot, rayHits, hitRecords);
+		}
+
+		// Get next start.
+		no = o + tNear * ray.direction;
+
+		// No later cell can give a closer hit.
+		if (rayHits != NULL && QueryDone(rayHits[slot], tOrigin + tNear))
+			break;
+	};
+}
+
+void Grid::AddHit(const Ray& ray, int triId, Scalar t, Scalar u, Scalar v, NearestHits* rayHits, int slot, HitList& hitRecords) const
+{
+	HitRecord hit = {ray.id, triId, t, u, v};
+	if (rayHits == NULL)
+		AddHitRecord(hit, hitRecords);
+	else
+		rayHits[slot].Add(hit);
+}
+
+bool Grid::QueryDone(const NearestHits& hit, Scalar tNext) const
+{
+	// The closest hits are final once they all lie before the start of the next cell.
+	if (QUERY == QUERY_ANY)
+		return hit.count > 0;
+
+	return hit.Full() && (hit.Farthest().t <= tNext);
+}
+
+void Grid::ReportHits(NearestHits& hit, HitList& hitRecords) const
+{
+	hit.Sort();
+	for (int i = 0; i < hit.count; ++i)
+		AddHitRecord(hit.hits[i], hitRecords);
+}
+
+void Grid::StartTraversal(const Ray& ray, const F3d& o, int c[3], Scalar t[3]) const
+{
+	// Find the start cell of the origin.
 	c[0] = int((o.x - GridBox.MinCorner.x) * InvCellSize.x);
 	c[1] = int((o.y - GridBox.MinCorner.y) * InvCellSize.y);
 	c[2] = int((o.z - GridBox.MinCorner.z) * InvCellSize.z);
 
-	assert ((c[0] >= 0) && (c[0] < CellNumber[0]) &&
-		(c[1] >= 0) && (c[1] < CellNumber[1]) &&
-		(c[2] >= 0) && (c[2] < CellNumber[2]));
+	// A segment in a nested grid starts on the cell border, keep it inside.
+	for (int i = 0; i < 3; ++i)
+	{
+		if (c[i] < 0)
+			c[i] = 0;
+		if (c[i] > CellNumber[i] - 1)
+			c[i] = CellNumber[i] - 1;
+	}
 
+	CellBorderT(ray, o, c, t);
+}
+
+void Grid::CellBorderT(const Ray& ray, const F3d& o, const int c[3], Scalar t[3]) const
+{
 	// Get initial tx.
-	Scalar t[3];
 	if (ray.sign[0] == 0)
 	{
 		t[0] = INFINITE_VALUE;
@@ -282,73 +1094,196 @@ void Grid::IntersectRay(const Ray& ray, List<F3d>& intersectPoints) const
 			t[2] = (CoordZ[c[2]] - o.z) * ray.invDirection.z;
 		}
 	}
+}
 
-	// 3DDA. Access the grid cells.
-	Scalar tNear = 0;
-	Scalar tLen = 0;
-	F3d no = o;
-	while ((c[0] >= 0) && (c[0] < CellNumber[0]) &&
-		(c[1] >= 0) && (c[1] < CellNumber[1]) &&
-		(c[2] >= 0) && (c[2] < CellNumber[2]))
+int Grid::CellDistance(const int c[3]) const
+{
+	return CellDistances[(c[2] * CellNumber[1] + c[1]) * CellNumber[0] + c[0]];
+}
+
+bool Grid::SkipEmptyCells(const Ray& ray, const F3d& o, Scalar tEnd, int c[3], Scalar t[3], Scalar& tNear) const
+{
+	// The cells closer than the distance are all empty, leave their cube through
+	// the nearest of its borders.
+	int radius = CellDistance(c) - 1;
+	const Scalar* coord[3] = {CoordX, CoordY, CoordZ};
+	int first[3];
+	int last[3];
+	Scalar tExit = INFINITE_VALUE;
+	int exitAxis = 0;
+	for (int i = 0; i < 3; ++i)
 	{
-		assert(c[2] * (CellNumber[0] * CellNumber[1]) + c[1] * CellNumber[0] + c[0] >= 0);
-		assert(c[2] * (CellNumber[0] * CellNumber[1]) + c[1] * CellNumber[0] + c[0] < CellTotalNumber);
+		first[i] = (c[i] - radius > 0) ? c[i] - radius : 0;
+		last[i] = (c[i] + radius < CellNumber[i] - 1) ? c[i] + radius : CellNumber[i] - 1;
+		if (ray.sign[i] == 0)
+			continue;
 
-		// Get current cell.
-		int cellIndex = c[2] * (CellNumber[0] * CellNumber[1]) + c[1] * CellNumber[0] + c[0];
+		int border = (ray.sign[i] == 1) ? last[i] + 1 : first[i];
+		Scalar tBorder = (coord[i][border] - o[i]) * ray.invDirection[i];
+		if (tBorder < tExit)
+		{
+			tExit = tBorder;
+			exitAxis = i;
+		}
+	}
 
-		// Find the next cell.
-		int minIndex = 0;
-		if (t[1] < t[minIndex])
-			minIndex = 1;
-		if (t[2] < t[minIndex])
-			minIndex = 2;
+	if (tExit < tNear)
+		tExit = tNear;
+	if (tExit >= tEnd)
+		return false;
 
-		tLen = t[minIndex] - tNear;
-		tNear = t[minIndex];
-		t[minIndex] += ray.dt[minIndex];
-		c[minIndex] += ray.sign[minIndex];		
+	// Find the cell the ray enters, it is next to the cube on the exit axis.
+	F3d p = o + tExit * ray.direction;
+	for (int i = 0; i < 3; ++i)
+	{
+		if (i == exitAxis)
+		{
+			c[i] = (ray.sign[i] == 1) ? last[i] + 1 : first[i] - 1;
+			continue;
+		}
 
-		// Test current cell.
-		tLen = (tLen - Scalar(1e-16) < 0) ? 0 : tLen - Scalar(1e-16);
-		IntersectRay(no, ray.direction, tLen, cellIndex, intersectPoints);
+		c[i] = int((p[i] - GridBox.MinCorner[i]) * InvCellSize[i]);
+		if (c[i] < first[i])
+			c[i] = first[i];
+		if (c[i] > last[i])
+			c[i] = last[i];
+	}
 
-		// Get next start.
-		no = o + tNear * ray.direction;
-	};
+	tNear = tExit;
+	if (CellInGrid(c))
+		CellBorderT(ray, o, c, t);
+
+	return true;
 }
 
-#if PARALLEL
-#if PARSE_INSIDE
-void Grid::IntersectRay(const F3d& o, const F3d& d, Scalar len, int cellIndex, TBB_List<char*>& intersectPoints) const
-#else
-void Grid::IntersectRay(const F3d& o, const F3d& d, Scalar len, int cellIndex, TBB_List<F3d>& intersectPoints) const
-#endif
-#else
-void Grid::IntersectRay(const F3d& o, const F3d& d, Scalar len, int cellIndex, List<F3d>& intersectPoints) const
-#endif
+bool Grid::CellInGrid(const int c[3]) const
 {
-    F3d intPt;
-    for (int i = CellOffset[cellIndex]; i < CellOffset[cellIndex + 1]; ++i)
+	return (c[0] >= 0) && (c[0] < CellNumber[0]) &&
+		(c[1] >= 0) && (c[1] < CellNumber[1]) &&
+		(c[2] >= 0) && (c[2] < CellNumber[2]);
+}
+
+int Grid::StepCell(const Ray& ray, const Scalar dt[3], Scalar tEnd, int c[3], Scalar t[3], Scalar& tNear, Scalar& tLen) const
+{
+	assert(c[2] * (CellNumber[0] * CellNumber[1]) + c[1] * CellNumber[0] + c[0] >= 0);
+	assert(c[2] * (CellNumber[0] * CellNumber[1]) + c[1] * CellNumber[0] + c[0] < CellTotalNumber);
+
+	// Get current cell.
+	int cellIndex = c[2] * (CellNumber[0] * CellNumber[1]) + c[1] * CellNumber[0] + c[0];
+
+	// Find the next cell.
+	int minIndex = 0;
+	if (t[1] < t[minIndex])
+		minIndex = 1;
+	if (t[2] < t[minIndex])
+		minIndex = 2;
+
+	Scalar tNext = (t[minIndex] < tEnd) ? t[minIndex] : tEnd;
+	tLen = tNext - tNear;
+	tNear = tNext;
+	t[minIndex] += dt[minIndex];
+	c[minIndex] += ray.sign[minIndex];		
+
+	tLen = (tLen - Scalar(1e-16) < 0) ? 0 : tLen - Scalar(1e-16);
+
+	return cellIndex;
+}
+
+void Grid::CellSteps(const Ray& ray, Scalar dt[3]) const
+{
+	dt[0] = (ray.sign[0] == 0) ? INFINITE_VALUE : CellSize.x * ray.invDirection.x * ray.sign[0];
+	dt[1] = (ray.sign[1] == 0) ? INFINITE_VALUE : CellSize.y * ray.invDirection.y * ray.sign[1];
+	dt[2] = (ray.sign[2] == 0) ? INFINITE_VALUE : CellSize.z * ray.invDirection.z * ray.sign[2];
+}
+
+void Grid::IntersectSubGrid(const Ray& ray, const F3d& o, Scalar tOrigin, Scalar len, int cellIndex, Mailbox* mailbox, TraversalStats* stats, int slot, NearestHits* rayHits, HitList& hitRecords) const
+{
+	if (stats != NULL)
+		++stats->subGridsVisited;
+
+	// Walk the nested grid along the segment in this cell.
+	const Grid* subGrid = CellSubGrids[cellIndex];
+	Scalar subDt[3];
+	subGrid->CellSteps(ray, subDt);
+	subGrid->IntersectRay(ray, o, tOrigin, len, subDt, mailbox, stats, slot, rayHits, hitRecords);
+}
+
+void Grid::IntersectCell(const Ray& ray, const F3d& o, Scalar tOrigin, Scalar len, int cellIndex, Mailbox* mailbox, TraversalStats* stats, int slot, NearestHits* rayHits, HitList& hitRecords) const
+{
+    const F3d& d = ray.direction;
+#if COMPACT_CELLS
+    // The blocks of the cell go to the kernel KERNEL_BLOCKS at a time, the hits are added in lane order.
+    const TriangleBlock* block = CellBlocks + CellBlockOffset[cellIndex];
+    int count = CellOffset[cellIndex + 1] - CellOffset[cellIndex];
+    KernelHits hits;
+    for (int i = 0; i < count; i += KERNEL_LANES, block += KERNEL_BLOCKS)
     {
-        if (rayTriangleIntersect(o, d, len, *(CellTriangles[i]), intPt))
+        int laneCount = (count - i < KERNEL_LANES) ? count - i : KERNEL_LANES;
+        int blockCount = (laneCount + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        unsigned int valid = (1u << laneCount) - 1;
+
+        // Lanes whose triangle can't be hit in this cell.
+        if (mailbox != NULL)
         {
-#if PARSE_INSIDE
-            char *buf = new char[128];
-#if CUSTOM_OUT
-            vertex2str_g(&intPt.x, buf);
-#else
-            sprintf_s( buf, 128, "%g %g %g\r\n", intPt.x,intPt.y,intPt.z );
-#endif
-            intersectPoints.push_back(buf);
+            for (int lane = 0; lane < laneCount; ++lane)
+            {
+                if (!mailbox->MayHit(block[lane / BLOCK_SIZE].id[lane % BLOCK_SIZE], o, d, tOrigin, len))
+                    valid &= ~(1u << lane);
+            }
+            if (valid == 0)
+                continue;
+        }
+
+        if (stats != NULL)
+            stats->trianglesTested += bitCount(valid);
+
+        unsigned int mask = IntersectBlocks(o, d, len, block, blockCount, hits) & valid;
+        for (int lane = 0; mask != 0; ++lane, mask >>= 1)
+        {
+            if (mask & 1)
+                AddHit(ray, block[lane / BLOCK_SIZE].id[lane % BLOCK_SIZE], tOrigin + hits.t[lane], hits.u[lane], hits.v[lane], rayHits, slot, hitRecords);
+        }
+
+        // Any hit will do.
+        if (rayHits != NULL && QUERY == QUERY_ANY && rayHits[slot].count > 0)
+            return;
+    }
 #else
-            intersectPoints.push_back(intPt);
-#endif
+    Scalar t, u, v;
+    for (int i = CellOffset[cellIndex]; i < CellOffset[cellIndex + 1]; ++i)
+    {
+        int id = int(CellTriangles[i] - Triangles);
+        if (mailbox != NULL && !mailbox->MayHit(id, o, d, tOrigin, len))
+            continue;
+
+        if (stats != NULL)
+            ++stats->trianglesTested;
+
+        if (rayTriangleHit(o, d, len, Records[id], t, u, v))
+        {
+            AddHit(ray, id, tOrigin + t, u, v, rayHits, slot, hitRecords);
+            if (rayHits != NULL && QUERY == QUERY_ANY)
+                return;
         }
     }
+#endif
+}
+
+Scalar Grid::OriginError(const Ray& ray) const
+{
+	// The cell origins are o + t * d rounded, with o + t * d inside the grid box.
+	const F3d* points[3] = {&ray.origin, &GridBox.MinCorner, &GridBox.MaxCorner};
+	Scalar extent = 0.0f;
+	for (int i = 0; i < 3; ++i)
+	{
+		extent = std::max(extent, fabs(points[i]->x));
+		extent = std::max(extent, fabs(points[i]->y));
+		extent = std::max(extent, fabs(points[i]->z));
+	}
+	return 32.0f * FLT_EPSILON * 2.0f * extent;
 }
 
-bool Grid::TestRayToSceneBox(const Ray& ray, Scalar& tIn) const
+bool Grid::TestRayToSceneBox(const Ray& ray, Scalar& tIn, TraversalStats* stats) const
 {
 	// If ray.origin in the scene box, no need to clip.
 	if (SceneBox.PointInBox(ray.origin))
@@ -363,11 +1298,51 @@ bool Grid::TestRayToSceneBox(const Ray& ray, Scalar& tIn) const
 	
 	// Do ray-box inersect, and find the t-value of the intersect point.
 	if (rayBoxIntersect(ray, SceneBox, tIn))
+	{
+		if (stats != NULL)
+			++stats->clippedRays;
 		return true;
+	}
 
+	if (stats != NULL)
+		++stats->missedRays;
 	return false;
 }
 
+void Grid::CountCell(int cellIndex, TraversalStats* stats) const
+{
+	++stats->cellsVisited;
+	if (CellOffset[cellIndex + 1] == CellOffset[cellIndex])
+		++stats->emptyCells;
+}
+
+void Grid::FillStatsReport(StatsReport& report) const
+{
+	report.HasGrid = true;
+	report.CellNumber[0] = CellNumber[0];
+	report.CellNumber[1] = CellNumber[1];
+	report.CellNumber[2] = CellNumber[2];
+	report.TriangleNumber = TriangleNumber;
+	report.ReferenceNumber = CellOffset[CellTotalNumber];
+
+	// The cells with a nested grid count with all their triangles.
+	report.SubGridNumber = 0;
+	for (int i = 0; i < OCCUPANCY_BIN_NUMBER; ++i)
+		report.Occupancy[i] = 0;
+	for (int i = 0; i < CellTotalNumber; ++i)
+	{
+		++report.Occupancy[occupancyBin(CellOffset[i + 1] - CellOffset[i])];
+		if (CellSubGrids != NULL && CellSubGrids[i] != NULL)
+			++report.SubGridNumber;
+	}
+
+	report.BuildPhases = BuildPhases;
+
+	report.Threads.clear();
+	for (tbb::enumerable_thread_specific<TraversalStats>::const_iterator it = ThreadStats.begin(); it != ThreadStats.end(); ++it)
+		report.Threads.push_back(*it);
+}
+
 Grid::~Grid()
 {
 	delete [] CoordX;
@@ -376,4 +1351,19 @@ Grid::~Grid()
 
 	delete [] CellOffset;
     delete [] CellTriangles;
+
+	if (CellBlocks != NULL)
+		tbb::cache_aligned_allocator<TriangleBlock>().deallocate(CellBlocks, allocatedBlockNumber(CellBlockOffset[CellTotalNumber]));
+	delete [] CellBlockOffset;
+
+	if (CellSubGrids != NULL)
+	{
+		for (int i = 0; i < CellTotalNumber; ++i)
+			delete CellSubGrids[i];
+		delete [] CellSubGrids;
+	}
+
+	delete [] CellDistances;
+	if (OwnRecords)
+		delete [] Records;
 }
\ No newline at end of file
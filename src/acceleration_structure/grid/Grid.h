@@ -3,8 +3,145 @@
 
 #include "Geometry.h"
 #include "Container.h"
+#include "Accelerator.h"
+#include "Stats.h"
 
-struct Grid
+// tbb includes
+#include "enumerable_thread_specific.h"
+
+// std includes
+#include <algorithm>
+#include <float.h>
+
+struct MailboxEntry
+{
+	unsigned int	stamp;
+
+	// Range of the ray parameter where the triangle may be hit, empty if it can't be.
+	Scalar			tLow;
+	Scalar			tHigh;
+};
+
+// Triangles met by the current ray, one entry per triangle tagged with the stamp of the
+// ray, so nothing is cleared between the rays. The first cell meeting a triangle finds
+// where along the whole ray the triangle may be hit, allowing for the error of the cell
+// origins. The cells overlapping that range test the triangle over their segment as
+// without the mailbox, the others skip it, so the hits are the same.
+struct Mailbox
+{
+	List<MailboxEntry>		Entries;
+	const TriangleRecord*	Records;
+	unsigned int			Stamp;
+
+	// Largest error of a cell origin along each axis for the current ray.
+	Scalar					Error;
+
+	Mailbox()
+		: Records(NULL)
+		, Stamp(0)
+		, Error(0.0f)
+	{
+	}
+
+	// Start a new ray over num triangles.
+	void Next(const TriangleRecord* records, int num, Scalar error)
+	{
+		Records = records;
+		Error = error;
+		if (Entries.size() < size_t(num))
+		{
+			MailboxEntry empty = {0, 0.0f, 0.0f};
+			Entries.resize(size_t(num), empty);
+		}
+
+		++Stamp;
+		if (Stamp == 0)
+		{
+			for (size_t i = 0; i < Entries.size(); ++i)
+				Entries[i].stamp = 0;
+			Stamp = 1;
+		}
+	}
+
+	// True if the ray may hit the triangle in the cell, where the ray enters at o, tOrigin
+	// along the ray, for len.
+	bool MayHit(int id, const F3d& o, const F3d& d, Scalar tOrigin, Scalar len)
+	{
+		MailboxEntry& entry = Entries[size_t(id)];
+		if (entry.stamp != Stamp)
+		{
+			entry.stamp = Stamp;
+			if (!rayTriangleSpan(o, d, tOrigin, Records[id], Error, entry.tLow, entry.tHigh))
+			{
+				entry.tLow = INFINITE_VALUE;
+				entry.tHigh = -INFINITE_VALUE;
+			}
+		}
+
+		// Rounding of the segment ends.
+		Scalar slack = 4.0f * FLT_EPSILON * (fabs(tOrigin) + len);
+		return (entry.tHigh >= tOrigin - slack) && (entry.tLow <= tOrigin + len + slack);
+	}
+};
+
+// Hits reported for a ray: all of them, the closest one, any one, or the first QUERY_K.
+enum QueryMode
+{
+	QUERY_ALL,
+	QUERY_CLOSEST,
+	QUERY_ANY,
+	QUERY_FIRST_K
+};
+
+const int MAX_QUERY_HITS = 16;
+
+// Closest hits of a ray found so far, at most capacity of them. They are kept in a
+// max heap, the farthest one on top is replaced by closer hits.
+struct NearestHits
+{
+	HitRecord	hits[MAX_QUERY_HITS];
+	int			count;
+	int			capacity;
+
+	NearestHits()
+		: count(0)
+		, capacity(1)
+	{
+	}
+
+	void Add(const HitRecord& hit)
+	{
+		if (count < capacity)
+		{
+			hits[count++] = hit;
+			std::push_heap(hits, hits + count);
+		}
+		else if (hit < hits[0])
+		{
+			std::pop_heap(hits, hits + count);
+			hits[count - 1] = hit;
+			std::push_heap(hits, hits + count);
+		}
+	}
+
+	bool Full() const
+	{
+		return count == capacity;
+	}
+
+	const HitRecord& Farthest() const
+	{
+		return hits[0];
+	}
+
+	// Sort the hits along the ray, the heap is gone.
+	void Sort()
+	{
+		std::sort_heap(hits, hits + count);
+	}
+};
+
+struct Grid : public Accelerator
 {
 public:
 	// Bounding box of the grid.
@@ -25,10 +162,43 @@ public:
 	Scalar*		CoordY;
 	Scalar*		CoordZ;
 
+	// Input triangles, the triangle ids index this array.
+	Triangle*	Triangles;
+	int			TriangleNumber;
+
 	// Cells.
     int*        CellOffset;
 	Triangle**	CellTriangles;
 
+	// Nested grids of the crowded cells in two-level mode, NULL for the other cells.
+	Grid**		CellSubGrids;
+
+	// Chebyshev distance of the cells to the nearest occupied cell, in cells, at most 255.
+	// NULL unless empty space skipping is on.
+	unsigned char*	CellDistances;
+
+	// Mailboxes of the threads, top level grid only.
+	mutable tbb::enumerable_thread_specific<Mailbox>	Mailboxes;
+
+	// Intersection records of the triangles, indexed by triangle id. The nested grids use
+	// the records of the top level grid, which owns them.
+	TriangleRecord*	Records;
+	bool			OwnRecords;
+
+	// Traversal counters of the threads, top level grid only, counted in stats mode.
+	mutable tbb::enumerable_thread_specific<TraversalStats>	ThreadStats;
+
+	// Wall time of the build steps, top level grid only.
+	List<PhaseTime>	BuildPhases;
+
+	// Cell references dropped by the exact overlap test.
+	int			RemovedReferenceNumber;
+
+	// Compact copy of the cell triangles, cell i owns the blocks from CellBlockOffset[i]
+	// to CellBlockOffset[i + 1]. Cells with a nested grid own no block.
+	int*			CellBlockOffset;
+	TriangleBlock*	CellBlocks;
+
 public:
 	// Grid density.
 	static float            GRID_DENSITY;
@@ -37,6 +207,44 @@ public:
 
 	static Scalar			DELTA;
 
+	// Two-level mode, cells with more triangles than the threshold get a nested grid.
+	static bool				TWO_LEVEL;
+
+	static int				SUBGRID_THRESHOLD;
+
+	// Auto resolution mode, the density and the per-axis cell numbers come from a cost model.
+	static bool				AUTO_RESOLUTION;
+
+	// Relative cost of stepping a cell and of testing a triangle in the cost model.
+	static Scalar			STEP_COST;
+	static Scalar			INTERSECT_COST;
+
+	// Exact mode, a triangle only goes to the cells it really overlaps, rather than
+	// all the cells its bounding box touches.
+	static bool				EXACT_OVERLAP;
+
+	// Packet mode, up to PACKET_SIZE consecutive rays of the same octant walk the grid together,
+	// if the cosine between their directions is at least the coherence.
+	static bool				PACKET_TRAVERSAL;
+
+	static Scalar			PACKET_COHERENCE;
+
+	// Mailbox mode, a ray skips a triangle in the cells that can't hold its hit. Each thread
+	// keeps an entry per triangle, the packets of the packet mode don't use it.
+	static bool				MAILBOXING;
+
+	// Empty space skipping mode, the traversal jumps over the empty cells in one step.
+	static bool				EMPTY_SPACE_SKIPPING;
+
+	// Hits reported per ray. The queries other than all end the traversal early.
+	static QueryMode		QUERY;
+
+	// Hit number of the first k query, at most MAX_QUERY_HITS.
+	static int				QUERY_K;
+
+	// Stats mode, the threads count the rays, cells and triangle tests of the traversal.
+	static bool				COLLECT_STATS;
+
 public:
 	Grid();
 
@@ -49,33 +257,95 @@ public:
 
 	void SubDivide(int num);
 
+	void SubDivide(int cellCount, F3d diagonal);
+
+	template <class TriangleArray>
+	void AutoSubDivide(TriangleArray triangles, int num);
+
+	template <class TriangleArray>
+	F3d GetCentroidExtent(TriangleArray triangles, int num) const;
+
+	template <class TriangleArray>
+	Scalar EstimateCost(TriangleArray triangles, int num);
+
+	void CalculateCellSize();
+
 	void CalculateCoordinates();
 
-	void CategorizeTriangles(Triangle* triangles, int num);
+	bool InitializeSubGrid(Triangle** triangles, int num, const Box& cellBox, Triangle* base, TriangleRecord* baseRecords);
+
+	template <class TriangleArray>
+	void CategorizeTriangles(TriangleArray triangles, int num);
+
+	void CategorizeTrianglesParallel(Triangle* triangles, int num);
+
+	void CreateSubGrids();
+
+	void CreateSubGrid(int index);
+
+	void PrepareRecords();
+
+	void CompactCells();
+
+	void CompactCell(int index);
+
+	void CreateCellDistances();
 
 	void IntersectTriangleBBox(Triangle& triangle, int startIndex[], int endIndex[]);
 
-#if PARALLEL
-#if PARSE_INSIDE
-	void IntersectRay(const Ray& ray, TBB_List<char*>& intersectPoints) const;
-    void IntersectRay(const F3d& o, const F3d& d, Scalar len, int cellIndex, TBB_List<char*>& intersectPoints) const;
-#else
-    void IntersectRay(const Ray& ray, TBB_List<F3d>& intersectPoints) const;
-    void IntersectRay(const F3d& o, const F3d& d, Scalar len, int cellIndex, TBB_List<F3d>& intersectPoints) const;
-#endif
-#else    
-	void IntersectRay(const Ray& ray, List<F3d>& intersectPoints) const;
-    void IntersectRay(const F3d& o, const F3d& d, Scalar len, int cellIndex, List<F3d>& intersectPoints) const;
-#endif
-
-#if PARALLEL
-
-	
-#else
-	
-#endif
-
-	bool TestRayToSceneBox(const Ray& ray, Scalar& tIn) const;
+	bool NeedOverlapTest(const int startIndex[], const int endIndex[]) const;
+
+	bool TriangleInCell(const Triangle& triangle, int x, int y, int z) const;
+
+	void IntersectRay(const Ray& ray, HitList& hitRecords) const;
+	void IntersectRay(const Ray& ray, TraversalStats* stats, HitList& hitRecords) const;
+	void IntersectRay(const Ray& ray, const F3d& o, Scalar tOrigin, Scalar tEnd, const Scalar dt[3], Mailbox* mailbox, TraversalStats* stats, int slot, NearestHits* rayHits, HitList& hitRecords) const;
+
+	void IntersectCell(const Ray& ray, const F3d& o, Scalar tOrigin, Scalar len, int cellIndex, Mailbox* mailbox, TraversalStats* stats, int slot, NearestHits* rayHits, HitList& hitRecords) const;
+
+	void IntersectRays(const Ray* rays, int num, HitList& hitRecords) const;
+
+	bool RaysCoherent(const Ray& first, const Ray& ray) const;
+
+	void IntersectPacket(const Ray* rays, int count, TraversalStats* stats, HitList& hitRecords) const;
+	void IntersectPacket(const Ray* rays, unsigned int group, const F3d* o, const Scalar* tOrigin, const Scalar* len, int cellIndex, TraversalStats* stats, NearestHits* rayHits, HitList& hitRecords) const;
+
+	void AddHit(const Ray& ray, int triId, Scalar t, Scalar u, Scalar v, NearestHits* rayHits, int slot, HitList& hitRecords) const;
+
+	bool QueryDone(const NearestHits& hit, Scalar tNext) const;
+
+	void ReportHits(NearestHits& hit, HitList& hitRecords) const;
+
+	void StartTraversal(const Ray& ray, const F3d& o, int c[3], Scalar t[3]) const;
+
+	// Ray parameter from one cell border to the next along each axis.
+	void CellSteps(const Ray& ray, Scalar dt[3]) const;
+
+	void CellBorderT(const Ray& ray, const F3d& o, const int c[3], Scalar t[3]) const;
+
+	bool CellInGrid(const int c[3]) const;
+
+	int CellDistance(const int c[3]) const;
+
+	bool SkipEmptyCells(const Ray& ray, const F3d& o, Scalar tEnd, int c[3], Scalar t[3], Scalar& tNear) const;
+
+	int StepCell(const Ray& ray, const Scalar dt[3], Scalar tEnd, int c[3], Scalar t[3], Scalar& tNear, Scalar& tLen) const;
+
+	void IntersectSubGrid(const Ray& ray, const F3d& o, Scalar tOrigin, Scalar len, int cellIndex, Mailbox* mailbox, TraversalStats* stats, int slot, NearestHits* rayHits, HitList& hitRecords) const;
+
+	// Error of the cell origins of the ray along each axis, for the mailbox.
+	Scalar OriginError(const Ray& ray) const;
+
+	bool TestRayToSceneBox(const Ray& ray, Scalar& tIn, TraversalStats* stats) const;
+
+	// Counters of the calling thread, NULL unless in stats mode.
+	TraversalStats* LocalStats() const;
+
+	// Count the cell visited in the stats.
+	void CountCell(int cellIndex, TraversalStats* stats) const;
+
+	// Grid shape, cell occupancy, build times and the counters of the threads.
+	void FillStatsReport(StatsReport& report) const;
 };
 
 #endif
\ No newline at end of file
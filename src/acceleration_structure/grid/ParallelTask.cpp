@@ -2,38 +2,256 @@
 #include "ParallelTask.h"
 #include "Tools.h"
 
+// std includes
+#include <algorithm>
+
 using namespace std;
 
 #if PARALLEL
 void RayParallel::operator()(const tbb::blocked_range<int>& r) const
+{
+    HitList& hitRecords = mLocalHits.local();
+    size_t first = hitRecords.size();
+    mScene->IntersectRays(mRays + r.begin(), r.end() - r.begin(), hitRecords);
+
+    // The rays of the range belong to this task only.
+    for (size_t i = first; i < hitRecords.size(); ++i)
+        ++mHitCounts[hitRecords[i].rayId];
+}
+
+void PlaceHitTask::operator()(const tbb::blocked_range<int>& r) const
+{
+    for(int i = r.begin(); i != r.end(); ++i)
+    {
+        const HitList& hitRecords = *mLists[i];
+        for (size_t j = 0; j < hitRecords.size(); ++j)
+            mOutput[mCursors[hitRecords[j].rayId]++] = hitRecords[j];
+    }
+}
+
+void SortHitTask::operator()(const tbb::blocked_range<int>& r) const
+{
+    for(int i = r.begin(); i != r.end(); ++i)
+    {
+        if (mOffset[i + 1] - mOffset[i] > 1)
+            std::sort(mOutput + mOffset[i], mOutput + mOffset[i + 1]);
+    }
+}
+
+void FormatChunkTask::operator()(const tbb::blocked_range<int>& r) const
+{
+    for(int i = r.begin(); i != r.end(); ++i)
+    {
+        long long begin = mFirst + (long long)i * mChunkHits;
+        int count = (mNum - begin < mChunkHits) ? int(mNum - begin) : mChunkHits;
+        mLengths[i] = FormatHits(mHits + begin, count, mRays, 0, mFormat, mBuffers[i]);
+    }
+}
+
+void WriteChunkTask::operator()(const tbb::blocked_range<int>& r) const
 {
     for(int i = r.begin(); i != r.end(); ++i)
     {
-		mGrid->IntersectRay(mRays[i], mIntersectPoints);
+        mWritten[i] = mFile.WriteAt(mBuffers[i], mLengths[i], mOffsets[i]);
     }
 }
 
-void ParseTriangleTask::operator()(const tbb::blocked_range<int>& r) const
+void LoadTask::operator()(const tbb::blocked_range<long long>& r)
+{
+    for(long long i = r.begin(); i != r.end(); ++i)
+    {
+        if (i < mTriangleNumber)
+        {
+            const BasicTriangle& btri = mBasicTriangles[i];
+            Triangle& triangle = mTriangles[i];
+
+            triangle.p0 = btri.vertex[0];
+            triangle.p1 = btri.vertex[1];
+            triangle.p2 = btri.vertex[2];
+            triangle.CalculateBox();
+            mBox.Extent(triangle.box);
+        }
+        else
+        {
+            long long j = i - mTriangleNumber;
+            const BasicRay& bray = mBasicRays[j];
+            Ray& ray = mRays[j];
+
+            ray.origin = bray.original;
+            ray.direction = bray.direction;
+            ray.id = int(j);
+            rayPreCompute(ray);
+        }
+    }
+}
+
+void LoadTask::join(const LoadTask& task)
+{
+	mBox.Extent(task.mBox);
+}
+
+void CountLineTask::operator()(const tbb::blocked_range<int>& r) const
 {
     for(int i = r.begin(); i != r.end(); ++i)
     {
-		BasicTriangle& btri = mBasicTriangles[i];
+        mLines[i] = CountTextLines(mBounds[i], mBounds[i + 1]);
+    }
+}
 
-		mTriangles[i].p0 = btri.vertex[0];
-		mTriangles[i].p1 = btri.vertex[1];
-		mTriangles[i].p2 = btri.vertex[2];
+void ParseLineTask::operator()(const tbb::blocked_range<int>& r) const
+{
+    for(int i = r.begin(); i != r.end(); ++i)
+    {
+        int num = ParseTextLines(mBounds[i], mBounds[i + 1], mValues + mFirstValue[i]);
+        mParsed[i] = (num == mFirstValue[i + 1] - mFirstValue[i]);
     }
 }
 
-void ParseRayTask::operator()(const tbb::blocked_range<int>& r) const
+void RayKeyTask::operator()(const tbb::blocked_range<int>& r) const
 {
     for(int i = r.begin(); i != r.end(); ++i)
     {
-		BasicRay& bray = mBasicRays[i];
+		mKeys[i] = rayOrderKey(mRays[i], mBox);
+    }
+}
 
-		mRays[i].origin = bray.original;
-		mRays[i].direction = bray.direction;
+void GatherRayTask::operator()(const tbb::blocked_range<int>& r) const
+{
+    for(int i = r.begin(); i != r.end(); ++i)
+    {
+		mSortedRays[i] = mRays[mOrder[i]];
     }
 }
 
+void CountCellTask::operator()(const tbb::blocked_range<int>& r) const
+{
+    const int* cellNumber = mGrid->CellNumber;
+    for(int b = r.begin(); b != r.end(); ++b)
+    {
+        int* counts = mCounts + (long long)b * mGrid->CellTotalNumber;
+        for (int i = 0; i < mGrid->CellTotalNumber; ++i)
+            counts[i] = 0;
+
+        int removed = 0;
+        int end = rangeBegin(mNum, mRangeNumber, b + 1);
+        for(int n = rangeBegin(mNum, mRangeNumber, b); n != end; ++n)
+        {
+            int startIndex[3], endIndex[3];
+            mGrid->IntersectTriangleBBox(mTriangles[n], startIndex, endIndex);
+            bool overlapTest = mGrid->NeedOverlapTest(startIndex, endIndex);
+
+            for (int i = startIndex[2]; i <= endIndex[2]; ++i)
+            {
+                for (int j = startIndex[1]; j <= endIndex[1]; ++j)
+                {
+                    for (int k = startIndex[0]; k <= endIndex[0]; ++k)
+                    {
+                        if (overlapTest && !mGrid->TriangleInCell(mTriangles[n], k, j, i))
+                        {
+                            removed++;
+                            continue;
+                        }
+
+                        int index = (cellNumber[0]*cellNumber[1])*i + cellNumber[0]*j + k;
+                        ++counts[index];
+                    }
+                }
+            }
+        }
+        mRemoved[b] = removed;
+    }
+}
+
+void ScatterCellTask::operator()(const tbb::blocked_range<int>& r) const
+{
+    const int* cellNumber = mGrid->CellNumber;
+    for(int b = r.begin(); b != r.end(); ++b)
+    {
+        int* cursors = mCursors + (long long)b * mGrid->CellTotalNumber;
+
+        int end = rangeBegin(mNum, mRangeNumber, b + 1);
+        for(int n = rangeBegin(mNum, mRangeNumber, b); n != end; ++n)
+        {
+            int startIndex[3], endIndex[3];
+            mGrid->IntersectTriangleBBox(mTriangles[n], startIndex, endIndex);
+            bool overlapTest = mGrid->NeedOverlapTest(startIndex, endIndex);
+
+            for (int i = startIndex[2]; i <= endIndex[2]; ++i)
+            {
+                for (int j = startIndex[1]; j <= endIndex[1]; ++j)
+                {
+                    for (int k = startIndex[0]; k <= endIndex[0]; ++k)
+                    {
+                        if (overlapTest && !mGrid->TriangleInCell(mTriangles[n], k, j, i))
+                            continue;
+
+                        int index = (cellNumber[0]*cellNumber[1])*i + cellNumber[0]*j + k;
+                        mGrid->CellTriangles[--cursors[index]] = &mTriangles[n];
+                    }
+                }
+            }
+        }
+    }
+}
+
+void PrepareRecordTask::operator()(const tbb::blocked_range<int>& r) const
+{
+    for(int i = r.begin(); i != r.end(); ++i)
+    {
+		mGrid->Records[i].Prepare(mGrid->Triangles[i]);
+    }
+}
+
+void CompactCellTask::operator()(const tbb::blocked_range<int>& r) const
+{
+    for(int i = r.begin(); i != r.end(); ++i)
+    {
+		mGrid->CompactCell(i);
+    }
+}
+
+void SubGridTask::operator()(const tbb::blocked_range<int>& r) const
+{
+    for(int i = r.begin(); i != r.end(); ++i)
+    {
+		mGrid->CreateSubGrid(i);
+    }
+}
+
+void* ReadChunkFilter::operator()(void*)
+{
+    if (mFailed || mNextRay >= mRayNumber)
+        return NULL;
+
+    RayChunk& chunk = mChunks[mNextChunk % mChunkNumber];
+    int num = (mRayNumber - mNextRay < STREAM_CHUNK_RAYS) ? int(mRayNumber - mNextRay) : STREAM_CHUNK_RAYS;
+    if (!ReadRayChunk(mFile, mNextRay, num, chunk))
+    {
+        mFailed = true;
+        return NULL;
+    }
+
+    mNextRay += num;
+    ++mNextChunk;
+    return &chunk;
+}
+
+void* TraceChunkFilter::operator()(void* item)
+{
+    RayChunk& chunk = *static_cast<RayChunk*>(item);
+    TraceRayChunk(*mScene, mFormat, chunk);
+    return &chunk;
+}
+
+void* WriteChunkFilter::operator()(void* item)
+{
+    RayChunk& chunk = *static_cast<RayChunk*>(item);
+    if (mWritten && chunk.length > 0)
+        mWritten = mFile.WriteAt(&chunk.output[0], chunk.length, mOffset);
+
+    mOffset += chunk.length;
+    mHitNumber += chunk.hitRecords.size();
+    return NULL;
+}
+
 #endif
\ No newline at end of file
@@ -2,35 +2,37 @@
 #define _PARALLEL_TASK_H_
 
 #include "Geometry.h"
+#include "Accelerator.h"
 #include "Grid.h"
+#include "Tools.h"
+#include "RayStream.h"
 
 // tbb includes
 #include "parallel_for.h"
+#include "parallel_reduce.h"
+#include "parallel_scan.h"
+#include "pipeline.h"
+#include "enumerable_thread_specific.h"
 
 // std includes
 #include <vector>
 
 #if PARALLEL
+// Trace the rays, the hits go to the list of the thread and are counted per ray.
 class RayParallel
 {
 protected:
     Ray* mRays;
-    Grid* mGrid;
-#if PARSE_INSIDE
-    TBB_List<char*>& mIntersectPoints;
-#else
-    TBB_List<F3d>& mIntersectPoints;
-#endif
+    Accelerator* mScene;
+    tbb::enumerable_thread_specific<HitList>& mLocalHits;
+    int* mHitCounts;
 
 public:
-#if PARSE_INSIDE
-    RayParallel(Ray* rays, Grid* scene, TBB_List<char*>& ret)
-#else
-    RayParallel(Ray* rays, Grid* scene, TBB_List<F3d>& ret)
-#endif
+    RayParallel(Ray* rays, Accelerator* scene, tbb::enumerable_thread_specific<HitList>& localHits, int* hitCounts)
         : mRays(rays)
-        , mGrid(scene)
-        , mIntersectPoints(ret)
+        , mScene(scene)
+        , mLocalHits(localHits)
+        , mHitCounts(hitCounts)
     {
     }
 
@@ -40,36 +42,457 @@ private:
     RayParallel & operator=( const RayParallel& );
 };
 
-class ParseTriangleTask
+// Prefix sum of the hit counts, offset[i + 1] gets the end of the hits of ray i.
+class ScanHitTask
 {
 protected:
-    Triangle* mTriangles;
-    BasicTriangle* mBasicTriangles;
+    const int* mCounts;
+    long long* mOffset;
+    long long mSum;
+public:
+    ScanHitTask(const int* counts, long long* offset)
+        : mCounts(counts)
+        , mOffset(offset)
+        , mSum(0)
+    {}
+    ScanHitTask(ScanHitTask& task, tbb::split)
+        : mCounts(task.mCounts)
+        , mOffset(task.mOffset)
+        , mSum(0)
+    {}
+    template <typename Tag>
+    void operator()(const tbb::blocked_range<int>& r, Tag)
+    {
+        long long sum = mSum;
+        for(int i = r.begin(); i != r.end(); ++i)
+        {
+            sum += mCounts[i];
+            if (Tag::is_final_scan())
+                mOffset[i + 1] = sum;
+        }
+        mSum = sum;
+    }
+    void reverse_join(ScanHitTask& task) { mSum = task.mSum + mSum; }
+    void assign(ScanHitTask& task) { mSum = task.mSum; }
+};
+
+// Copy the hits of the thread lists to their place in the output. The hits of a ray
+// are all in one list, so every cursor is moved by one task only.
+class PlaceHitTask
+{
+protected:
+    HitList** mLists;
+    long long* mCursors;
+    HitRecord* mOutput;
+public:
+    PlaceHitTask(HitList** lists, long long* cursors, HitRecord* output)
+        : mLists(lists)
+        , mCursors(cursors)
+        , mOutput(output)
+    {}
+    void operator()(const tbb::blocked_range<int>& r) const;
+
+private:
+    PlaceHitTask & operator=( const PlaceHitTask& );
+};
+
+// Sort the hits of each ray, so the output does not depend on the schedule.
+class SortHitTask
+{
+protected:
+    const long long* mOffset;
+    HitRecord* mOutput;
 public:
-    ParseTriangleTask(Triangle* triangle, BasicTriangle* basicTriangles) 
-        : mTriangles(triangle)
-        , mBasicTriangles(basicTriangles)
+    SortHitTask(const long long* offset, HitRecord* output)
+        : mOffset(offset)
+        , mOutput(output)
     {}
     void operator()(const tbb::blocked_range<int>& r) const;
 
 private:
-    ParseTriangleTask & operator=( const ParseTriangleTask& );
+    SortHitTask & operator=( const SortHitTask& );
 };
 
-class ParseRayTask
+// Format chunks of chunkHits hits, chunk i starts at hit first + i * chunkHits.
+class FormatChunkTask
 {
 protected:
+    const HitRecord* mHits;
+    long long mNum;
+    long long mFirst;
+    int mChunkHits;
+    const BasicRay* mRays;
+    HitFormat mFormat;
+    char** mBuffers;
+    int* mLengths;
+public:
+    FormatChunkTask(const HitRecord* hits, long long num, long long first, int chunkHits, const BasicRay* rays, HitFormat format, char** buffers, int* lengths)
+        : mHits(hits)
+        , mNum(num)
+        , mFirst(first)
+        , mChunkHits(chunkHits)
+        , mRays(rays)
+        , mFormat(format)
+        , mBuffers(buffers)
+        , mLengths(lengths)
+    {}
+    void operator()(const tbb::blocked_range<int>& r) const;
+
+private:
+    FormatChunkTask & operator=( const FormatChunkTask& );
+};
+
+// Write the formatted chunks at their offsets in the file.
+class WriteChunkTask
+{
+protected:
+    const OutputFile& mFile;
+    char** mBuffers;
+    const int* mLengths;
+    const long long* mOffsets;
+    bool* mWritten;
+public:
+    WriteChunkTask(const OutputFile& file, char** buffers, const int* lengths, const long long* offsets, bool* written)
+        : mFile(file)
+        , mBuffers(buffers)
+        , mLengths(lengths)
+        , mOffsets(offsets)
+        , mWritten(written)
+    {}
+    void operator()(const tbb::blocked_range<int>& r) const;
+
+private:
+    WriteChunkTask & operator=( const WriteChunkTask& );
+};
+
+// Fill the triangles and the rays from the input records in one pass, the indices below
+// the triangle number are triangles, the others rays. The indices are 64 bits, the two
+// numbers together may pass INT_MAX. The triangle boxes are calculated
+// and joined in mBox on the way, and the rays are precomputed.
+class LoadTask
+{
+protected:
+    const BasicTriangle* mBasicTriangles;
+    long long mTriangleNumber;
+    Triangle* mTriangles;
+    const BasicRay* mBasicRays;
     Ray* mRays;
-    BasicRay* mBasicRays;
 public:
-    ParseRayTask(Ray* rays, BasicRay* basicRays) 
-        : mRays(rays)
+    Box mBox;
+
+    LoadTask(const BasicTriangle* basicTriangles, long long triangleNumber, Triangle* triangles, const BasicRay* basicRays, Ray* rays)
+        : mBasicTriangles(basicTriangles)
+        , mTriangleNumber(triangleNumber)
+        , mTriangles(triangles)
         , mBasicRays(basicRays)
+        , mRays(rays)
+    {}
+    LoadTask(LoadTask& task, tbb::split)
+        : mBasicTriangles(task.mBasicTriangles)
+        , mTriangleNumber(task.mTriangleNumber)
+        , mTriangles(task.mTriangles)
+        , mBasicRays(task.mBasicRays)
+        , mRays(task.mRays)
+    {}
+    void operator()(const tbb::blocked_range<long long>& r);
+    void join(const LoadTask& task);
+};
+
+// Text input, count the lines of the chunks, chunk i goes from bounds[i] to bounds[i + 1].
+class CountLineTask
+{
+protected:
+    const char* const* mBounds;
+    int* mLines;
+public:
+    CountLineTask(const char* const* bounds, int* lines)
+        : mBounds(bounds)
+        , mLines(lines)
     {}
     void operator()(const tbb::blocked_range<int>& r) const;
 
 private:
-    ParseRayTask & operator=( const ParseRayTask& );
+    CountLineTask & operator=( const CountLineTask& );
+};
+
+// Parse the lines of the chunks, the values of chunk i go from firstValue[i] to firstValue[i + 1].
+class ParseLineTask
+{
+protected:
+    const char* const* mBounds;
+    const int* mFirstValue;
+    Scalar* mValues;
+    bool* mParsed;
+public:
+    ParseLineTask(const char* const* bounds, const int* firstValue, Scalar* values, bool* parsed)
+        : mBounds(bounds)
+        , mFirstValue(firstValue)
+        , mValues(values)
+        , mParsed(parsed)
+    {}
+    void operator()(const tbb::blocked_range<int>& r) const;
+
+private:
+    ParseLineTask & operator=( const ParseLineTask& );
+};
+
+// Sort keys of the rays, see rayOrderKey.
+class RayKeyTask
+{
+protected:
+    const Ray* mRays;
+    Box mBox;
+    unsigned int* mKeys;
+public:
+    RayKeyTask(const Ray* rays, const Box& box, unsigned int* keys)
+        : mRays(rays)
+        , mBox(box)
+        , mKeys(keys)
+    {}
+    void operator()(const tbb::blocked_range<int>& r) const;
+
+private:
+    RayKeyTask & operator=( const RayKeyTask& );
+};
+
+// Copy the rays in the sorted order.
+class GatherRayTask
+{
+protected:
+    const Ray* mRays;
+    const int* mOrder;
+    Ray* mSortedRays;
+public:
+    GatherRayTask(const Ray* rays, const int* order, Ray* sortedRays)
+        : mRays(rays)
+        , mOrder(order)
+        , mSortedRays(sortedRays)
+    {}
+    void operator()(const tbb::blocked_range<int>& r) const;
+
+private:
+    GatherRayTask & operator=( const GatherRayTask& );
+};
+
+// The parallel grid build splits the triangles into ranges, range b goes from
+// num * b / rangeNumber to num * (b + 1) / rangeNumber. Every range has its own row
+// of cell counts, counts + b * CellTotalNumber.
+inline int rangeBegin(int num, int rangeNumber, int b)
+{
+    return int((long long)num * b / rangeNumber);
+}
+
+// First pass of the grid build, count the triangles of each cell per range.
+class CountCellTask
+{
+protected:
+    Grid* mGrid;
+    Triangle* mTriangles;
+    int mNum;
+    int mRangeNumber;
+    int* mCounts;
+    int* mRemoved;
+public:
+    CountCellTask(Grid* grid, Triangle* triangles, int num, int rangeNumber, int* counts, int* removed)
+        : mGrid(grid)
+        , mTriangles(triangles)
+        , mNum(num)
+        , mRangeNumber(rangeNumber)
+        , mCounts(counts)
+        , mRemoved(removed)
+    {}
+    void operator()(const tbb::blocked_range<int>& r) const;
+
+private:
+    CountCellTask & operator=( const CountCellTask& );
+};
+
+// Prefix sum of the cell counts. offset[i + 1] gets the end of cell i, and the counts
+// of cell i are replaced by the scatter cursors of the ranges. The last range comes first
+// in the cell, and every range fills its part from the end, so the triangles of a cell
+// are in descending order, the same as the serial build.
+class ScanCellTask
+{
+protected:
+    int* mCounts;
+    int mRangeNumber;
+    int mCellNumber;
+    int* mOffset;
+    int mSum;
+public:
+    ScanCellTask(int* counts, int rangeNumber, int cellNumber, int* offset)
+        : mCounts(counts)
+        , mRangeNumber(rangeNumber)
+        , mCellNumber(cellNumber)
+        , mOffset(offset)
+        , mSum(0)
+    {}
+    ScanCellTask(ScanCellTask& task, tbb::split)
+        : mCounts(task.mCounts)
+        , mRangeNumber(task.mRangeNumber)
+        , mCellNumber(task.mCellNumber)
+        , mOffset(task.mOffset)
+        , mSum(0)
+    {}
+    template <typename Tag>
+    void operator()(const tbb::blocked_range<int>& r, Tag)
+    {
+        int sum = mSum;
+        for(int i = r.begin(); i != r.end(); ++i)
+        {
+            for (int b = mRangeNumber - 1; b >= 0; --b)
+            {
+                int* count = mCounts + (long long)b * mCellNumber + i;
+                sum += *count;
+                if (Tag::is_final_scan())
+                    *count = sum;
+            }
+            if (Tag::is_final_scan())
+                mOffset[i + 1] = sum;
+        }
+        mSum = sum;
+    }
+    void reverse_join(ScanCellTask& task) { mSum = task.mSum + mSum; }
+    void assign(ScanCellTask& task) { mSum = task.mSum; }
+};
+
+// Second pass of the grid build, put the triangle pointers into the cells, every
+// range at its own cursors.
+class ScatterCellTask
+{
+protected:
+    Grid* mGrid;
+    Triangle* mTriangles;
+    int mNum;
+    int mRangeNumber;
+    int* mCursors;
+public:
+    ScatterCellTask(Grid* grid, Triangle* triangles, int num, int rangeNumber, int* cursors)
+        : mGrid(grid)
+        , mTriangles(triangles)
+        , mNum(num)
+        , mRangeNumber(rangeNumber)
+        , mCursors(cursors)
+    {}
+    void operator()(const tbb::blocked_range<int>& r) const;
+
+private:
+    ScatterCellTask & operator=( const ScatterCellTask& );
+};
+
+// Precompute the edges of the triangles.
+class PrepareRecordTask
+{
+protected:
+    Grid* mGrid;
+public:
+    PrepareRecordTask(Grid* grid)
+        : mGrid(grid)
+    {}
+    void operator()(const tbb::blocked_range<int>& r) const;
+
+private:
+    PrepareRecordTask & operator=( const PrepareRecordTask& );
+};
+
+// Copy the cell triangles into the compact blocks.
+class CompactCellTask
+{
+protected:
+    Grid* mGrid;
+public:
+    CompactCellTask(Grid* grid)
+        : mGrid(grid)
+    {}
+    void operator()(const tbb::blocked_range<int>& r) const;
+
+private:
+    CompactCellTask & operator=( const CompactCellTask& );
+};
+
+// Create the nested grids of the crowded cells.
+class SubGridTask
+{
+protected:
+    Grid* mGrid;
+public:
+    SubGridTask(Grid* grid)
+        : mGrid(grid)
+    {}
+    void operator()(const tbb::blocked_range<int>& r) const;
+
+private:
+    SubGridTask & operator=( const SubGridTask& );
+};
+
+// Stream mode, the chunks of rays are read in order, traced in parallel and written in order.
+// The pipeline holds at most chunkNumber chunks at once, so chunk k can use the buffers
+// chunks[k % chunkNumber].
+class ReadChunkFilter : public tbb::filter
+{
+protected:
+    FILE* mFile;
+    long long mRayNumber;
+    RayChunk* mChunks;
+    int mChunkNumber;
+    long long mNextRay;
+    int mNextChunk;
+    bool mFailed;
+public:
+    ReadChunkFilter(FILE* file, long long rayNumber, RayChunk* chunks, int chunkNumber)
+        : tbb::filter(serial_in_order)
+        , mFile(file)
+        , mRayNumber(rayNumber)
+        , mChunks(chunks)
+        , mChunkNumber(chunkNumber)
+        , mNextRay(0)
+        , mNextChunk(0)
+        , mFailed(false)
+    {}
+    void* operator()(void* item);
+
+    // True if the file ended before the last ray.
+    bool Failed() const { return mFailed; }
+};
+
+class TraceChunkFilter : public tbb::filter
+{
+protected:
+    const Accelerator* mScene;
+    HitFormat mFormat;
+public:
+    TraceChunkFilter(const Accelerator* scene, HitFormat format)
+        : tbb::filter(parallel)
+        , mScene(scene)
+        , mFormat(format)
+    {}
+    void* operator()(void* item);
+};
+
+// Write the output of the chunks one after another from offset.
+class WriteChunkFilter : public tbb::filter
+{
+protected:
+    const OutputFile& mFile;
+    long long mOffset;
+    long long mHitNumber;
+    bool mWritten;
+public:
+    WriteChunkFilter(const OutputFile& file, long long offset)
+        : tbb::filter(serial_in_order)
+        , mFile(file)
+        , mOffset(offset)
+        , mHitNumber(0)
+        , mWritten(true)
+    {}
+    void* operator()(void* item);
+
+    long long HitNumber() const { return mHitNumber; }
+
+    bool Written() const { return mWritten; }
+
+private:
+    WriteChunkFilter & operator=( const WriteChunkFilter& );
 };
 
 #endif
@@ -0,0 +1,184 @@
+#include "Common.h"
+#include "PerfCounters.h"
+
+// system include.
+#include <errno.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// The generic cache miss event counts the last level cache misses.
+static const unsigned long long PERF_CONFIGS[PERF_EVENT_NUMBER] =
+{
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES
+};
+
+// Counter of the event on the calling thread, on any cpu, -1 if it can't be opened.
+static int openEvent(int event)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_CONFIGS[event];
+
+	// User mode only, so no privilege is needed up to perf_event_paranoid 2.
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	return int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+}
+#endif
+
+PerfCounters::PerfCounters()
+	: mStarted(false)
+	, mError(0)
+{
+	for (int e = 0; e < PERF_EVENT_NUMBER; ++e)
+	{
+		mEventOpen[e] = false;
+		mLastCounts[e] = 0;
+	}
+}
+
+PerfCounters::~PerfCounters()
+{
+	if (mStarted)
+		observe(false);
+
+#ifdef __linux__
+	for (size_t i = 0; i < mCounters.size(); ++i)
+	{
+		if (mCounters[i] >= 0)
+			close(mCounters[i]);
+	}
+#endif
+}
+
+bool PerfCounters::Start()
+{
+#ifdef __linux__
+	// Find the events the system counts, a virtual machine may have none of them.
+	bool anyEvent = false;
+	for (int e = 0; e < PERF_EVENT_NUMBER; ++e)
+	{
+		int counter = openEvent(e);
+		if (counter >= 0)
+		{
+			mEventOpen[e] = true;
+			anyEvent = true;
+			close(counter);
+		}
+		else if (mError == 0)
+		{
+			mError = errno;
+		}
+	}
+	if (!anyEvent)
+		return false;
+
+	mStarted = true;
+	OpenThread();
+	observe(true);
+	Read(mLastCounts);
+	return true;
+#else
+	mError = ENOSYS;
+	return false;
+#endif
+}
+
+const char* PerfCounters::Error() const
+{
+	switch (mError)
+	{
+	case 0:
+		return "";
+	case ENOENT:
+	case EOPNOTSUPP:
+		return "the cpu events are not supported here";
+	case EACCES:
+	case EPERM:
+		return "not allowed, see /proc/sys/kernel/perf_event_paranoid";
+	case ENOSYS:
+		return "no perf events on this system";
+	default:
+		return strerror(mError);
+	}
+}
+
+void PerfCounters::on_scheduler_entry(bool)
+{
+	if (mStarted)
+		OpenThread();
+}
+
+void PerfCounters::OpenThread()
+{
+#ifdef __linux__
+	long long thread = (long long)syscall(SYS_gettid);
+
+	tbb::spin_mutex::scoped_lock lock(mMutex);
+	for (size_t i = 0; i < mThreads.size(); ++i)
+	{
+		if (mThreads[i] == thread)
+			return;
+	}
+
+	mThreads.push_back(thread);
+	for (int e = 0; e < PERF_EVENT_NUMBER; ++e)
+		mCounters.push_back(mEventOpen[e] ? openEvent(e) : -1);
+#endif
+}
+
+void PerfCounters::Read(long long counts[PERF_EVENT_NUMBER])
+{
+	for (int e = 0; e < PERF_EVENT_NUMBER; ++e)
+		counts[e] = mEventOpen[e] ? 0 : -1;
+
+#ifdef __linux__
+	tbb::spin_mutex::scoped_lock lock(mMutex);
+	for (size_t i = 0; i < mCounters.size(); ++i)
+	{
+		if (mCounters[i] < 0)
+			continue;
+
+		// The count, then the times the event was enabled and really counted.
+		unsigned long long values[3];
+		if (read(mCounters[i], values, sizeof(values)) != ssize_t(sizeof(values)))
+			continue;
+
+		double count = double(values[0]);
+		if (values[2] > 0 && values[2] < values[1])
+			count *= double(values[1]) / double(values[2]);
+		counts[i % PERF_EVENT_NUMBER] += (long long)count;
+	}
+#endif
+}
+
+void PerfCounters::EndPhase(const char* name)
+{
+	long long counts[PERF_EVENT_NUMBER];
+	Read(counts);
+
+	PhaseCounters phase;
+	phase.name = name;
+	for (int e = 0; e < PERF_EVENT_NUMBER; ++e)
+	{
+		phase.counts[e] = (counts[e] < 0) ? -1 : counts[e] - mLastCounts[e];
+		mLastCounts[e] = counts[e];
+	}
+	mPhases.push_back(phase);
+}
+
+const List<PhaseCounters>& PerfCounters::Phases() const
+{
+	return mPhases;
+}
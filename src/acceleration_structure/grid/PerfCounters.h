@@ -0,0 +1,56 @@
+#ifndef _PERF_COUNTERS_H_
+#define _PERF_COUNTERS_H_
+
+#include "Container.h"
+#include "Stats.h"
+
+// tbb includes
+#include "task_scheduler_observer.h"
+#include "spin_mutex.h"
+
+// Hardware counters of the calling thread and of the TBB threads, from the Linux
+// perf events. Every thread counts its own user mode events, the counts of all the
+// threads are added up per phase. Without perf events, or if the system doesn't
+// allow them (perf_event_paranoid), nothing is counted and the phases get -1.
+class PerfCounters : public tbb::task_scheduler_observer
+{
+public:
+	PerfCounters();
+
+	~PerfCounters();
+
+	// Open the counters of the calling thread, the TBB threads get theirs when they
+	// join. False if no event can be counted, Error tells why.
+	bool Start();
+
+	const char* Error() const;
+
+	// Counts of the threads since the previous phase, or since Start.
+	void EndPhase(const char* name);
+
+	const List<PhaseCounters>& Phases() const;
+
+	virtual void on_scheduler_entry(bool is_worker);
+
+private:
+	// Open the events of the calling thread, once per thread.
+	void OpenThread();
+
+	// Counts of all the threads so far, scaled when the events were multiplexed.
+	void Read(long long counts[PERF_EVENT_NUMBER]);
+
+	// Counters of the threads, PERF_EVENT_NUMBER per thread, -1 for the events not counted.
+	List<int>			mCounters;
+	List<long long>		mThreads;
+	tbb::spin_mutex		mMutex;
+
+	// Events the system counts, found by Start.
+	bool				mEventOpen[PERF_EVENT_NUMBER];
+	bool				mStarted;
+	int					mError;
+
+	long long			mLastCounts[PERF_EVENT_NUMBER];
+	List<PhaseCounters>	mPhases;
+};
+
+#endif
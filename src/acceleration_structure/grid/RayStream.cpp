@@ -0,0 +1,58 @@
+#include "Common.h"
+#include "RayStream.h"
+
+// std includes
+#include <algorithm>
+
+RayChunk::RayChunk()
+	: first(0)
+	, num(0)
+	, length(0)
+{
+	basicRays = new BasicRay[STREAM_CHUNK_RAYS];
+	rays = new Ray[STREAM_CHUNK_RAYS];
+}
+
+RayChunk::~RayChunk()
+{
+	delete [] basicRays;
+	delete [] rays;
+}
+
+bool ReadRayChunk(FILE* file, long long first, int num, RayChunk& chunk)
+{
+	chunk.first = first;
+	chunk.num = num;
+	return fread(chunk.basicRays, sizeof(BasicRay), num, file) == size_t(num);
+}
+
+void TraceRayChunk(const Accelerator& scene, HitFormat format, RayChunk& chunk)
+{
+	for (int i = 0; i < chunk.num; ++i)
+	{
+		const BasicRay& bray = chunk.basicRays[i];
+
+		chunk.rays[i].origin = bray.original;
+		chunk.rays[i].direction = bray.direction;
+		chunk.rays[i].id = i;
+		rayPreCompute(chunk.rays[i]);
+	}
+
+	chunk.hits.reset();
+	scene.IntersectRays(chunk.rays, chunk.num, chunk.hits);
+
+	// Same order as the whole output, by ray then along the ray.
+	int hitNumber = int(chunk.hits.size());
+	chunk.hitRecords.resize(hitNumber);
+	for (int i = 0; i < hitNumber; ++i)
+		chunk.hitRecords[i] = chunk.hits[i];
+	std::sort(chunk.hitRecords.begin(), chunk.hitRecords.end(), HitOutputOrder);
+
+	chunk.length = 0;
+	if (hitNumber > 0)
+	{
+		if (chunk.output.size() < size_t(hitNumber) * MAX_HIT_LINE)
+			chunk.output.resize(size_t(hitNumber) * MAX_HIT_LINE);
+		chunk.length = FormatHits(&chunk.hitRecords[0], hitNumber, chunk.basicRays, chunk.first, format, &chunk.output[0]);
+	}
+}
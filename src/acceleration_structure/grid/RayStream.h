@@ -0,0 +1,52 @@
+#ifndef _RAY_STREAM_H_
+#define _RAY_STREAM_H_
+
+#include "Geometry.h"
+#include "Container.h"
+#include "Accelerator.h"
+#include "Tools.h"
+
+// system include.
+#include <stdio.h>
+
+// Rays read at a time in the stream mode.
+const int STREAM_CHUNK_RAYS = 1 << 16;
+
+// Consecutive rays of the input traced together in the stream mode, with their hits
+// and the output of the hits. The buffers are kept from one chunk to the next.
+struct RayChunk
+{
+	// Index of the first ray in the input, and the ray number. The ids of the rays and
+	// of the hits count from the first ray of the chunk.
+	long long			first;
+	int					num;
+
+	BasicRay*			basicRays;
+	Ray*				rays;
+
+	// Hits found by the traversal, then in the order of the output.
+	HitList				hits;
+	List<HitRecord>		hitRecords;
+
+	// Text or records of the hits.
+	List<char>			output;
+	int					length;
+
+	RayChunk();
+
+	~RayChunk();
+
+private:
+	RayChunk(const RayChunk&);
+	RayChunk& operator = (const RayChunk&);
+};
+
+// Read num (at most STREAM_CHUNK_RAYS) rays from the file, the first one being the ray first.
+// False if the file ends before.
+bool ReadRayChunk(FILE* file, long long first, int num, RayChunk& chunk);
+
+// Precompute and trace the rays of the chunk, then format their hits. The output is the
+// part of these rays in the whole output.
+void TraceRayChunk(const Accelerator& scene, HitFormat format, RayChunk& chunk);
+
+#endif
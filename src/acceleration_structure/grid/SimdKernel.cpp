@@ -0,0 +1,441 @@
+#include "Common.h"
+#include "SimdKernel.h"
+#include <string.h>
+
+#if defined(__GNUC__) && !defined(__clang__)
+// Keep the multiplies and adds separate, as in rayTriangleHit.
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+// The vector kernels repeat the operations of rayTriangleHit in the same order, with
+// masked compares instead of the early returns, so they give bit identical results.
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SIMD_KERNELS 1
+#else
+#define SIMD_KERNELS 0
+#endif
+
+#if SIMD_KERNELS
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+// Distance between the same lane of two blocks, in Scalars.
+const int BLOCK_STRIDE = sizeof(TriangleBlock) / sizeof(Scalar);
+#endif
+
+unsigned int intersectBlocksScalar(const F3d& o, const F3d& d, Scalar len,
+								   const TriangleBlock* blocks, int blockCount,
+								   KernelHits& hits)
+{
+	unsigned int mask = 0;
+	for (int i = 0; i < blockCount * BLOCK_SIZE; ++i)
+	{
+		const TriangleBlock& block = blocks[i / BLOCK_SIZE];
+		int lane = i % BLOCK_SIZE;
+
+		TriangleRecord record;
+		record.p0 = F3d(block.p0[0][lane], block.p0[1][lane], block.p0[2][lane]);
+		record.e1 = F3d(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+		record.e2 = F3d(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+
+		if (rayTriangleHit(o, d, len, record, hits.t[i], hits.u[i], hits.v[i]))
+			mask |= 1u << i;
+	}
+	return mask;
+}
+
+unsigned int intersectPacketScalar(const PacketRays& rays, unsigned int active,
+								   const TriangleBlock& block, int lane,
+								   KernelHits& hits)
+{
+	TriangleRecord record;
+	record.p0 = F3d(block.p0[0][lane], block.p0[1][lane], block.p0[2][lane]);
+	record.e1 = F3d(block.e1[0][lane], block.e1[1][lane], block.e1[2][lane]);
+	record.e2 = F3d(block.e2[0][lane], block.e2[1][lane], block.e2[2][lane]);
+
+	unsigned int mask = 0;
+	for (int i = 0; i < PACKET_SIZE; ++i)
+	{
+		if (!(active & (1u << i)))
+			continue;
+
+		F3d o(rays.ox[i], rays.oy[i], rays.oz[i]);
+		F3d d(rays.dx[i], rays.dy[i], rays.dz[i]);
+		if (rayTriangleHit(o, d, rays.len[i], record, hits.t[i], hits.u[i], hits.v[i]))
+			mask |= 1u << i;
+	}
+	return mask;
+}
+
+#if SIMD_KERNELS
+// Test 4 ray / triangle pairs, store t, u and v of the hit lanes, return the hit mask.
+static inline unsigned int hitSse(__m128 ox, __m128 oy, __m128 oz,
+								  __m128 dx, __m128 dy, __m128 dz, __m128 l,
+								  __m128 p0x, __m128 p0y, __m128 p0z,
+								  __m128 e1x, __m128 e1y, __m128 e1z,
+								  __m128 e2x, __m128 e2y, __m128 e2z,
+								  Scalar* tOut, Scalar* uOut, Scalar* vOut)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 eps = _mm_set1_ps(EPSILON);
+	const __m128 negEps = _mm_set1_ps(-EPSILON);
+
+	// p = Cross(d, e2), det = Dot(e1, p).
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+
+	// s = o - p0, u = Dot(s, p).
+	__m128 sx = _mm_sub_ps(ox, p0x), sy = _mm_sub_ps(oy, p0y), sz = _mm_sub_ps(oz, p0z);
+	__m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz));
+
+	// q = Cross(s, e1), v = Dot(d, q), t = Dot(e2, q).
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+	__m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz));
+	__m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz));
+
+	__m128 uv = _mm_add_ps(u, v);
+	__m128 ld = _mm_mul_ps(l, det);
+
+	// det < -EPSILON.
+	__m128 rejectN = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmplt_ps(u, det)),
+		_mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(v, zero), _mm_cmplt_ps(uv, det)),
+		_mm_or_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, ld))));
+	__m128 hitN = _mm_andnot_ps(rejectN, _mm_cmplt_ps(det, negEps));
+
+	// det > EPSILON.
+	__m128 rejectP = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, det)),
+		_mm_or_ps(_mm_or_ps(_mm_cmplt_ps(v, zero), _mm_cmpgt_ps(uv, det)),
+		_mm_or_ps(_mm_cmplt_ps(t, zero), _mm_cmpgt_ps(t, ld))));
+	__m128 hitP = _mm_andnot_ps(rejectP, _mm_cmpgt_ps(det, eps));
+
+	unsigned int mask = (unsigned int)_mm_movemask_ps(_mm_or_ps(hitN, hitP));
+	if (mask == 0)
+		return 0;
+
+	__m128 invD = _mm_div_ps(one, det);
+	_mm_storeu_ps(tOut, _mm_mul_ps(t, invD));
+	_mm_storeu_ps(uOut, _mm_mul_ps(u, invD));
+	_mm_storeu_ps(vOut, _mm_mul_ps(v, invD));
+	return mask;
+}
+
+unsigned int intersectBlocksSse(const F3d& o, const F3d& d, Scalar len,
+								const TriangleBlock* blocks, int blockCount,
+								KernelHits& hits)
+{
+	const __m128 ox = _mm_set1_ps(o.x), oy = _mm_set1_ps(o.y), oz = _mm_set1_ps(o.z);
+	const __m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+	const __m128 l = _mm_set1_ps(len);
+
+	unsigned int mask = 0;
+	for (int b = 0; b < blockCount; ++b)
+	{
+		const TriangleBlock& block = blocks[b];
+		unsigned int blockMask = hitSse(ox, oy, oz, dx, dy, dz, l,
+			_mm_loadu_ps(block.p0[0]), _mm_loadu_ps(block.p0[1]), _mm_loadu_ps(block.p0[2]),
+			_mm_loadu_ps(block.e1[0]), _mm_loadu_ps(block.e1[1]), _mm_loadu_ps(block.e1[2]),
+			_mm_loadu_ps(block.e2[0]), _mm_loadu_ps(block.e2[1]), _mm_loadu_ps(block.e2[2]),
+			hits.t + b * BLOCK_SIZE, hits.u + b * BLOCK_SIZE, hits.v + b * BLOCK_SIZE);
+		mask |= blockMask << (b * BLOCK_SIZE);
+	}
+	return mask;
+}
+
+unsigned int intersectPacketSse(const PacketRays& rays, unsigned int active,
+								const TriangleBlock& block, int lane,
+								KernelHits& hits)
+{
+	const __m128 p0x = _mm_set1_ps(block.p0[0][lane]), p0y = _mm_set1_ps(block.p0[1][lane]), p0z = _mm_set1_ps(block.p0[2][lane]);
+	const __m128 e1x = _mm_set1_ps(block.e1[0][lane]), e1y = _mm_set1_ps(block.e1[1][lane]), e1z = _mm_set1_ps(block.e1[2][lane]);
+	const __m128 e2x = _mm_set1_ps(block.e2[0][lane]), e2y = _mm_set1_ps(block.e2[1][lane]), e2z = _mm_set1_ps(block.e2[2][lane]);
+
+	unsigned int mask = 0;
+	for (int i = 0; i < PACKET_SIZE; i += 4)
+	{
+		if (((active >> i) & 0xF) == 0)
+			continue;
+
+		unsigned int rayMask = hitSse(_mm_loadu_ps(rays.ox + i), _mm_loadu_ps(rays.oy + i), _mm_loadu_ps(rays.oz + i),
+			_mm_loadu_ps(rays.dx + i), _mm_loadu_ps(rays.dy + i), _mm_loadu_ps(rays.dz + i), _mm_loadu_ps(rays.len + i),
+			p0x, p0y, p0z, e1x, e1y, e1z, e2x, e2y, e2z,
+			hits.t + i, hits.u + i, hits.v + i);
+		mask |= rayMask << i;
+	}
+	return mask & active;
+}
+
+// Test 8 ray / triangle pairs, store t, u and v of the hit lanes, return the hit mask.
+TARGET_AVX2 static inline unsigned int hitAvx2(__m256 ox, __m256 oy, __m256 oz,
+											   __m256 dx, __m256 dy, __m256 dz, __m256 l,
+											   __m256 p0x, __m256 p0y, __m256 p0z,
+											   __m256 e1x, __m256 e1y, __m256 e1z,
+											   __m256 e2x, __m256 e2y, __m256 e2z,
+											   Scalar* tOut, Scalar* uOut, Scalar* vOut)
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 eps = _mm256_set1_ps(EPSILON);
+	const __m256 negEps = _mm256_set1_ps(-EPSILON);
+
+	__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+	__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+	__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+	__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+
+	__m256 sx = _mm256_sub_ps(ox, p0x), sy = _mm256_sub_ps(oy, p0y), sz = _mm256_sub_ps(oz, p0z);
+	__m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz));
+
+	__m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+	__m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+	__m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+	__m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz));
+	__m256 t = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz));
+
+	__m256 uv = _mm256_add_ps(u, v);
+	__m256 ld = _mm256_mul_ps(l, det);
+
+	__m256 rejectN = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(u, det, _CMP_LT_OQ)),
+		_mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(v, zero, _CMP_GT_OQ), _mm256_cmp_ps(uv, det, _CMP_LT_OQ)),
+		_mm256_or_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ), _mm256_cmp_ps(t, ld, _CMP_LT_OQ))));
+	__m256 hitN = _mm256_andnot_ps(rejectN, _mm256_cmp_ps(det, negEps, _CMP_LT_OQ));
+
+	__m256 rejectP = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(u, det, _CMP_GT_OQ)),
+		_mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(v, zero, _CMP_LT_OQ), _mm256_cmp_ps(uv, det, _CMP_GT_OQ)),
+		_mm256_or_ps(_mm256_cmp_ps(t, zero, _CMP_LT_OQ), _mm256_cmp_ps(t, ld, _CMP_GT_OQ))));
+	__m256 hitP = _mm256_andnot_ps(rejectP, _mm256_cmp_ps(det, eps, _CMP_GT_OQ));
+
+	unsigned int mask = (unsigned int)_mm256_movemask_ps(_mm256_or_ps(hitN, hitP));
+	if (mask == 0)
+		return 0;
+
+	__m256 invD = _mm256_div_ps(one, det);
+	_mm256_storeu_ps(tOut, _mm256_mul_ps(t, invD));
+	_mm256_storeu_ps(uOut, _mm256_mul_ps(u, invD));
+	_mm256_storeu_ps(vOut, _mm256_mul_ps(v, invD));
+	return mask;
+}
+
+// Lanes of two blocks, the second one is zero if it is missing.
+TARGET_AVX2 static inline __m256 load8(const Scalar* p, bool second)
+{
+	__m128 lo = _mm_loadu_ps(p);
+	__m128 hi = second ? _mm_loadu_ps(p + BLOCK_STRIDE) : _mm_setzero_ps();
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+TARGET_AVX2 unsigned int intersectBlocksAvx2(const F3d& o, const F3d& d, Scalar len,
+											 const TriangleBlock* blocks, int blockCount,
+											 KernelHits& hits)
+{
+	// Most cells hold a few triangles, a single block is not worth the wider registers.
+	if (blockCount == 1)
+		return intersectBlocksSse(o, d, len, blocks, blockCount, hits);
+
+	const __m256 ox = _mm256_set1_ps(o.x), oy = _mm256_set1_ps(o.y), oz = _mm256_set1_ps(o.z);
+	const __m256 dx = _mm256_set1_ps(d.x), dy = _mm256_set1_ps(d.y), dz = _mm256_set1_ps(d.z);
+	const __m256 l = _mm256_set1_ps(len);
+
+	unsigned int mask = 0;
+	for (int b = 0; b < blockCount; b += 2)
+	{
+		const TriangleBlock& block = blocks[b];
+		bool second = (b + 1 < blockCount);
+		unsigned int blockMask = hitAvx2(ox, oy, oz, dx, dy, dz, l,
+			load8(block.p0[0], second), load8(block.p0[1], second), load8(block.p0[2], second),
+			load8(block.e1[0], second), load8(block.e1[1], second), load8(block.e1[2], second),
+			load8(block.e2[0], second), load8(block.e2[1], second), load8(block.e2[2], second),
+			hits.t + b * BLOCK_SIZE, hits.u + b * BLOCK_SIZE, hits.v + b * BLOCK_SIZE);
+		mask |= blockMask << (b * BLOCK_SIZE);
+	}
+	return mask;
+}
+
+TARGET_AVX2 unsigned int intersectPacketAvx2(const PacketRays& rays, unsigned int active,
+											 const TriangleBlock& block, int lane,
+											 KernelHits& hits)
+{
+	unsigned int mask = hitAvx2(_mm256_loadu_ps(rays.ox), _mm256_loadu_ps(rays.oy), _mm256_loadu_ps(rays.oz),
+		_mm256_loadu_ps(rays.dx), _mm256_loadu_ps(rays.dy), _mm256_loadu_ps(rays.dz), _mm256_loadu_ps(rays.len),
+		_mm256_set1_ps(block.p0[0][lane]), _mm256_set1_ps(block.p0[1][lane]), _mm256_set1_ps(block.p0[2][lane]),
+		_mm256_set1_ps(block.e1[0][lane]), _mm256_set1_ps(block.e1[1][lane]), _mm256_set1_ps(block.e1[2][lane]),
+		_mm256_set1_ps(block.e2[0][lane]), _mm256_set1_ps(block.e2[1][lane]), _mm256_set1_ps(block.e2[2][lane]),
+		hits.t, hits.u, hits.v);
+	return mask & active;
+}
+
+// Lanes of up to four blocks, the missing ones are zero.
+TARGET_AVX512 static inline __m512 load16(const Scalar* p, int count)
+{
+	__m512 r = _mm512_setzero_ps();
+	r = _mm512_insertf32x4(r, _mm_loadu_ps(p), 0);
+	if (count > 1)
+		r = _mm512_insertf32x4(r, _mm_loadu_ps(p + BLOCK_STRIDE), 1);
+	if (count > 2)
+		r = _mm512_insertf32x4(r, _mm_loadu_ps(p + 2 * BLOCK_STRIDE), 2);
+	if (count > 3)
+		r = _mm512_insertf32x4(r, _mm_loadu_ps(p + 3 * BLOCK_STRIDE), 3);
+	return r;
+}
+
+TARGET_AVX512 unsigned int intersectBlocksAvx512(const F3d& o, const F3d& d, Scalar len,
+												 const TriangleBlock* blocks, int blockCount,
+												 KernelHits& hits)
+{
+	if (blockCount <= 2)
+		return intersectBlocksAvx2(o, d, len, blocks, blockCount, hits);
+
+	const __m512 zero = _mm512_setzero_ps();
+	const __m512 one = _mm512_set1_ps(1.0f);
+	const __m512 eps = _mm512_set1_ps(EPSILON);
+	const __m512 negEps = _mm512_set1_ps(-EPSILON);
+	const __m512 ox = _mm512_set1_ps(o.x), oy = _mm512_set1_ps(o.y), oz = _mm512_set1_ps(o.z);
+	const __m512 dx = _mm512_set1_ps(d.x), dy = _mm512_set1_ps(d.y), dz = _mm512_set1_ps(d.z);
+	const __m512 l = _mm512_set1_ps(len);
+
+	const TriangleBlock& block = blocks[0];
+	__m512 p0x = load16(block.p0[0], blockCount), p0y = load16(block.p0[1], blockCount), p0z = load16(block.p0[2], blockCount);
+	__m512 e1x = load16(block.e1[0], blockCount), e1y = load16(block.e1[1], blockCount), e1z = load16(block.e1[2], blockCount);
+	__m512 e2x = load16(block.e2[0], blockCount), e2y = load16(block.e2[1], blockCount), e2z = load16(block.e2[2], blockCount);
+
+	__m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(dz, e2y));
+	__m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(dx, e2z));
+	__m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(dy, e2x));
+	__m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, px), _mm512_mul_ps(e1y, py)), _mm512_mul_ps(e1z, pz));
+
+	__m512 sx = _mm512_sub_ps(ox, p0x), sy = _mm512_sub_ps(oy, p0y), sz = _mm512_sub_ps(oz, p0z);
+	__m512 u = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(sx, px), _mm512_mul_ps(sy, py)), _mm512_mul_ps(sz, pz));
+
+	__m512 qx = _mm512_sub_ps(_mm512_mul_ps(sy, e1z), _mm512_mul_ps(sz, e1y));
+	__m512 qy = _mm512_sub_ps(_mm512_mul_ps(sz, e1x), _mm512_mul_ps(sx, e1z));
+	__m512 qz = _mm512_sub_ps(_mm512_mul_ps(sx, e1y), _mm512_mul_ps(sy, e1x));
+	__m512 v = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)), _mm512_mul_ps(dz, qz));
+	__m512 t = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)), _mm512_mul_ps(e2z, qz));
+
+	__m512 uv = _mm512_add_ps(u, v);
+	__m512 ld = _mm512_mul_ps(l, det);
+
+	__mmask16 rejectN = _mm512_cmp_ps_mask(u, zero, _CMP_GT_OQ) | _mm512_cmp_ps_mask(u, det, _CMP_LT_OQ) |
+		_mm512_cmp_ps_mask(v, zero, _CMP_GT_OQ) | _mm512_cmp_ps_mask(uv, det, _CMP_LT_OQ) |
+		_mm512_cmp_ps_mask(t, zero, _CMP_GT_OQ) | _mm512_cmp_ps_mask(t, ld, _CMP_LT_OQ);
+	__mmask16 hitN = _mm512_cmp_ps_mask(det, negEps, _CMP_LT_OQ) & ~rejectN;
+
+	__mmask16 rejectP = _mm512_cmp_ps_mask(u, zero, _CMP_LT_OQ) | _mm512_cmp_ps_mask(u, det, _CMP_GT_OQ) |
+		_mm512_cmp_ps_mask(v, zero, _CMP_LT_OQ) | _mm512_cmp_ps_mask(uv, det, _CMP_GT_OQ) |
+		_mm512_cmp_ps_mask(t, zero, _CMP_LT_OQ) | _mm512_cmp_ps_mask(t, ld, _CMP_GT_OQ);
+	__mmask16 hitP = _mm512_cmp_ps_mask(det, eps, _CMP_GT_OQ) & ~rejectP;
+
+	unsigned int mask = (unsigned int)(hitN | hitP);
+	if (mask == 0)
+		return 0;
+
+	__m512 invD = _mm512_div_ps(one, det);
+	_mm512_storeu_ps(hits.t, _mm512_mul_ps(t, invD));
+	_mm512_storeu_ps(hits.u, _mm512_mul_ps(u, invD));
+	_mm512_storeu_ps(hits.v, _mm512_mul_ps(v, invD));
+	return mask;
+}
+
+static bool CpuHasAvx2()
+{
+#if defined(_MSC_VER)
+	int regs[4];
+	__cpuid(regs, 1);
+	bool osxsave = (regs[2] & (1 << 27)) != 0;
+	bool avx = (regs[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+		return false;
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+static bool CpuHasAvx512()
+{
+#if defined(_MSC_VER)
+	if (!CpuHasAvx2() || (_xgetbv(0) & 0xE6) != 0xE6)
+		return false;
+	int regs[4];
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 16)) != 0;
+#else
+	return __builtin_cpu_supports("avx512f") != 0;
+#endif
+}
+#endif
+
+struct KernelEntry
+{
+	const char*		name;
+	BlockKernel		kernel;
+	PacketKernel	packetKernel;
+	bool			(*supported)();
+};
+
+static bool Always()
+{
+	return true;
+}
+
+// Widest first.
+static const KernelEntry KERNELS[] =
+{
+#if SIMD_KERNELS
+	{"avx512", intersectBlocksAvx512, intersectPacketAvx2, CpuHasAvx512},
+	{"avx2", intersectBlocksAvx2, intersectPacketAvx2, CpuHasAvx2},
+	{"sse", intersectBlocksSse, intersectPacketSse, Always},
+#endif
+	{"scalar", intersectBlocksScalar, intersectPacketScalar, Always}
+};
+static const int KERNEL_NUMBER = sizeof(KERNELS) / sizeof(KERNELS[0]);
+
+static int DetectBlockKernel()
+{
+	for (int i = 0; i < KERNEL_NUMBER; ++i)
+	{
+		if (KERNELS[i].supported())
+			return i;
+	}
+	return KERNEL_NUMBER - 1;
+}
+
+static int KernelIndex = DetectBlockKernel();
+
+BlockKernel IntersectBlocks = KERNELS[KernelIndex].kernel;
+
+PacketKernel IntersectPacketTriangle = KERNELS[KernelIndex].packetKernel;
+
+const char* GetBlockKernelName()
+{
+	return KERNELS[KernelIndex].name;
+}
+
+bool SelectBlockKernel(const char* name)
+{
+	for (int i = 0; i < KERNEL_NUMBER; ++i)
+	{
+		if (strcmp(KERNELS[i].name, name) == 0 && KERNELS[i].supported())
+		{
+			KernelIndex = i;
+			IntersectBlocks = KERNELS[i].kernel;
+			IntersectPacketTriangle = KERNELS[i].packetKernel;
+			return true;
+		}
+	}
+	return false;
+}
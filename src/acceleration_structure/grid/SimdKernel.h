@@ -0,0 +1,67 @@
+#ifndef _SIMD_KERNEL_H_
+#define _SIMD_KERNEL_H_
+
+#include "Geometry.h"
+
+// Blocks tested by one kernel call, and the lanes they hold.
+const int KERNEL_BLOCKS = 4;
+const int KERNEL_LANES = KERNEL_BLOCKS * BLOCK_SIZE;
+
+// Ray parameter and barycentric coordinates of the lanes of a kernel call.
+// Only the hit lanes are valid.
+struct KernelHits
+{
+	Scalar	t[KERNEL_LANES];
+	Scalar	u[KERNEL_LANES];
+	Scalar	v[KERNEL_LANES];
+};
+
+// Test the segment [o, o + len * d] against blockCount (1 to KERNEL_BLOCKS) blocks.
+// Bit i of the result is set if lane i is hit, lane i being lane i % BLOCK_SIZE of block i / BLOCK_SIZE.
+// All kernels give the same hits and the same values as rayTriangleHit.
+typedef unsigned int (*BlockKernel)(const F3d& o, const F3d& d, Scalar len,
+									const TriangleBlock* blocks, int blockCount,
+									KernelHits& hits);
+
+unsigned int intersectBlocksScalar(const F3d& o, const F3d& d, Scalar len,
+								   const TriangleBlock* blocks, int blockCount,
+								   KernelHits& hits);
+
+// Rays of a packet, lane i holds the segment [o, o + len * d] of ray i in the current cell.
+const int PACKET_SIZE = 8;
+
+struct PacketRays
+{
+	Scalar	ox[PACKET_SIZE];
+	Scalar	oy[PACKET_SIZE];
+	Scalar	oz[PACKET_SIZE];
+	Scalar	dx[PACKET_SIZE];
+	Scalar	dy[PACKET_SIZE];
+	Scalar	dz[PACKET_SIZE];
+	Scalar	len[PACKET_SIZE];
+};
+
+// Test the active rays of the packet against one lane of a block.
+// Bit i of the result is set if ray i is hit, its values are in lane i of the hits.
+typedef unsigned int (*PacketKernel)(const PacketRays& rays, unsigned int active,
+									 const TriangleBlock& block, int lane,
+									 KernelHits& hits);
+
+unsigned int intersectPacketScalar(const PacketRays& rays, unsigned int active,
+								   const TriangleBlock& block, int lane,
+								   KernelHits& hits);
+
+// Kernel used by the traversal, the widest one the cpu supports.
+extern BlockKernel IntersectBlocks;
+
+// Packet kernel of the same instruction set.
+extern PacketKernel IntersectPacketTriangle;
+
+// Name of the kernels in use.
+const char* GetBlockKernelName();
+
+// Use the kernels of the given name (scalar, sse, avx2 or avx512).
+// False if it is unknown or not supported by the cpu.
+bool SelectBlockKernel(const char* name);
+
+#endif
@@ -0,0 +1,152 @@
+#include "Common.h"
+#include "Stats.h"
+
+// system include.
+#include <stdio.h>
+
+StatsReport::StatsReport()
+	: HasGrid(false)
+	, TriangleNumber(0)
+	, ReferenceNumber(0)
+	, SubGridNumber(0)
+	, RayNumber(0)
+{
+	CellNumber[0] = CellNumber[1] = CellNumber[2] = 0;
+	for (int i = 0; i < OCCUPANCY_BIN_NUMBER; ++i)
+		Occupancy[i] = 0;
+}
+
+void StatsReport::AddPhase(const char* name, double seconds)
+{
+	PhaseTime phase = {name, seconds};
+	Phases.push_back(phase);
+}
+
+static void writePhases(FILE* fp, const char* key, const List<PhaseTime>& phases)
+{
+	fprintf(fp, "  \"%s\": {", key);
+	for (size_t i = 0; i < phases.size(); ++i)
+		fprintf(fp, "%s\n    \"%s\": %.6f", (i == 0) ? "" : ",", phases[i].name, phases[i].seconds);
+	fprintf(fp, "%s},\n", phases.empty() ? "" : "\n  ");
+}
+
+static void writeCounters(FILE* fp, const TraversalStats& stats)
+{
+	fprintf(fp, "{\"rays\": %lld, \"clipped_rays\": %lld, \"missed_rays\": %lld, "
+		"\"cells_visited\": %lld, \"empty_cells\": %lld, \"empty_skips\": %lld, \"subgrids_visited\": %lld, "
+		"\"triangles_tested\": %lld, \"hits\": %lld}",
+		stats.rays, stats.clippedRays, stats.missedRays,
+		stats.cellsVisited, stats.emptyCells, stats.emptySkips, stats.subGridsVisited,
+		stats.trianglesTested, stats.hits);
+}
+
+static const char* PERF_EVENT_NAMES[PERF_EVENT_NUMBER] =
+{
+	"cycles", "instructions", "llc_misses", "branch_misses"
+};
+
+static void writeCount(FILE* fp, const char* name, long long count)
+{
+	if (count < 0)
+		fprintf(fp, "\"%s\": null", name);
+	else
+		fprintf(fp, "\"%s\": %lld", name, count);
+}
+
+static void writeRatio(FILE* fp, const char* name, long long count, long long base)
+{
+	if (count < 0 || base <= 0)
+		fprintf(fp, "\"%s\": null", name);
+	else
+		fprintf(fp, "\"%s\": %.4f", name, double(count) / double(base));
+}
+
+// Counts of the phases, with the instructions per cycle and the misses per ray.
+static void writePhaseCounters(FILE* fp, const List<PhaseCounters>& counters, long long rays)
+{
+	fprintf(fp, "  \"counters\": {");
+	for (size_t i = 0; i < counters.size(); ++i)
+	{
+		const long long* counts = counters[i].counts;
+		fprintf(fp, "%s\n    \"%s\": {", (i == 0) ? "" : ",", counters[i].name);
+		for (int e = 0; e < PERF_EVENT_NUMBER; ++e)
+		{
+			writeCount(fp, PERF_EVENT_NAMES[e], counts[e]);
+			fprintf(fp, ", ");
+		}
+		writeRatio(fp, "ipc", counts[PERF_INSTRUCTIONS], counts[PERF_CYCLES]);
+		fprintf(fp, ", ");
+		writeRatio(fp, "llc_misses_per_ray", counts[PERF_LLC_MISSES], rays);
+		fprintf(fp, ", ");
+		writeRatio(fp, "branch_misses_per_ray", counts[PERF_BRANCH_MISSES], rays);
+		fprintf(fp, "}");
+	}
+	fprintf(fp, "%s},\n", counters.empty() ? "" : "\n  ");
+}
+
+// Grid shape and occupancy histogram, then the counters of the threads and their total.
+static void writeGrid(FILE* fp, const StatsReport& report)
+{
+	// The histogram ends at the last bin with cells.
+	int binNumber = OCCUPANCY_BIN_NUMBER;
+	while (binNumber > 0 && report.Occupancy[binNumber - 1] == 0)
+		--binNumber;
+
+	fprintf(fp, "  \"grid\": {\n");
+	fprintf(fp, "    \"cells\": [%d, %d, %d],\n", report.CellNumber[0], report.CellNumber[1], report.CellNumber[2]);
+	fprintf(fp, "    \"triangles\": %d,\n", report.TriangleNumber);
+	fprintf(fp, "    \"references\": %lld,\n", report.ReferenceNumber);
+	fprintf(fp, "    \"subgrids\": %d,\n", report.SubGridNumber);
+	fprintf(fp, "    \"occupancy\": [");
+	for (int i = 0; i < binNumber; ++i)
+	{
+		int minTriangles = (i == 0) ? 0 : 1 << (i - 1);
+		fprintf(fp, "%s\n      {\"min\": %d, ", (i == 0) ? "" : ",", minTriangles);
+
+		// The last bin is open ended.
+		if (i == OCCUPANCY_BIN_NUMBER - 1)
+			fprintf(fp, "\"max\": null, ");
+		else
+			fprintf(fp, "\"max\": %d, ", (i == 0) ? 0 : (1 << i) - 1);
+		fprintf(fp, "\"cells\": %lld}", report.Occupancy[i]);
+	}
+	fprintf(fp, "%s]\n  },\n", (binNumber == 0) ? "" : "\n    ");
+
+	TraversalStats total;
+	fprintf(fp, "  \"threads\": [");
+	for (size_t i = 0; i < report.Threads.size(); ++i)
+	{
+		fprintf(fp, "%s\n    ", (i == 0) ? "" : ",");
+		writeCounters(fp, report.Threads[i]);
+		total.Add(report.Threads[i]);
+	}
+	fprintf(fp, "%s],\n", report.Threads.empty() ? "" : "\n  ");
+
+	fprintf(fp, "  \"total\": ");
+	writeCounters(fp, total);
+}
+
+bool StatsReport::Write(const char* filename) const
+{
+	FILE* fp = NULL;
+	fopen_s(&fp, filename, "wb");
+	if (fp == NULL)
+		return false;
+
+	fprintf(fp, "{\n");
+	writePhases(fp, "phases", Phases);
+	writePhases(fp, "build_phases", BuildPhases);
+	if (!Counters.empty())
+		writePhaseCounters(fp, Counters, RayNumber);
+
+	// Nothing was measured without a grid.
+	if (HasGrid)
+		writeGrid(fp, *this);
+	else
+		fprintf(fp, "  \"grid\": null,\n  \"threads\": null,\n  \"total\": null");
+	fprintf(fp, "\n}\n");
+
+	bool written = (ferror(fp) == 0);
+	fclose(fp);
+	return written;
+}
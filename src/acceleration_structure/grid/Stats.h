@@ -0,0 +1,137 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "Container.h"
+
+// Counters of the grid traversal. Every thread counts in its own copy,
+// the copies are added up for the report.
+struct TraversalStats
+{
+	// Rays traced.
+	long long	rays;
+
+	// Rays starting out of the scene box, clipped to it, and rays missing it.
+	long long	clippedRays;
+	long long	missedRays;
+
+	// Cells stepped through, nested grid cells included, and the empty ones of them.
+	long long	cellsVisited;
+	long long	emptyCells;
+
+	// Jumps over empty space, and nested grids walked.
+	long long	emptySkips;
+	long long	subGridsVisited;
+
+	// Ray-triangle tests, a packet test counts once per ray.
+	long long	trianglesTested;
+
+	// Hits reported.
+	long long	hits;
+
+	TraversalStats()
+		: rays(0)
+		, clippedRays(0)
+		, missedRays(0)
+		, cellsVisited(0)
+		, emptyCells(0)
+		, emptySkips(0)
+		, subGridsVisited(0)
+		, trianglesTested(0)
+		, hits(0)
+	{
+	}
+
+	void Add(const TraversalStats& other)
+	{
+		rays += other.rays;
+		clippedRays += other.clippedRays;
+		missedRays += other.missedRays;
+		cellsVisited += other.cellsVisited;
+		emptyCells += other.emptyCells;
+		emptySkips += other.emptySkips;
+		subGridsVisited += other.subGridsVisited;
+		trianglesTested += other.trianglesTested;
+		hits += other.hits;
+	}
+};
+
+// Wall time of a phase, in seconds.
+struct PhaseTime
+{
+	const char*	name;
+	double		seconds;
+};
+
+// Hardware events of PerfCounters.
+enum PerfEvent
+{
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_LLC_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_EVENT_NUMBER
+};
+
+// Hardware event counts of a phase over all the threads, -1 for the events not counted.
+struct PhaseCounters
+{
+	const char*	name;
+	long long	counts[PERF_EVENT_NUMBER];
+};
+
+inline int bitCount(unsigned int mask)
+{
+	int n = 0;
+	for (; mask != 0; mask &= mask - 1)
+		++n;
+	return n;
+}
+
+// Bins of the cell occupancy histogram: bin 0 counts the empty cells,
+// bin i the cells with 2^(i - 1) to 2^i - 1 triangles, the last bin every
+// cell with 2^(OCCUPANCY_BIN_NUMBER - 2) triangles or more.
+const int OCCUPANCY_BIN_NUMBER = 24;
+
+inline int occupancyBin(int triangles)
+{
+	int bin = 0;
+	while (triangles > 0 && bin < OCCUPANCY_BIN_NUMBER - 1)
+	{
+		triangles >>= 1;
+		++bin;
+	}
+	return bin;
+}
+
+// Everything the driver reports with the stats option.
+struct StatsReport
+{
+	// Phases of the driver, then of the structure build.
+	List<PhaseTime>			Phases;
+	List<PhaseTime>			BuildPhases;
+
+	// Grid shape, the top level grid. The grid, the threads and the total are
+	// written as null unless a grid filled them, the BVH doesn't.
+	bool					HasGrid;
+	int						CellNumber[3];
+	int						TriangleNumber;
+	long long				ReferenceNumber;
+	int						SubGridNumber;
+	long long				Occupancy[OCCUPANCY_BIN_NUMBER];
+
+	// Counters of the threads, in no particular order.
+	List<TraversalStats>	Threads;
+
+	// Hardware counts of the driver phases, and the rays they are divided by.
+	List<PhaseCounters>		Counters;
+	long long				RayNumber;
+
+	StatsReport();
+
+	void AddPhase(const char* name, double seconds);
+
+	// Write the report as JSON, false if the file can't be written.
+	bool Write(const char* filename) const;
+};
+
+#endif
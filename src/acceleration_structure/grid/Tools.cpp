@@ -1,286 +1,673 @@
 #include "Common.h"
+#include "Geometry.h"
+#include "Accelerator.h"
 #include "Tools.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <ctype.h>
 
-void SubdivideVertexStr(char* str, char* subStr[])
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SCAN 1
+#include <emmintrin.h>
+#else
+#define SIMD_SCAN 0
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Truncated 128 bit values of 5^q for q from -65 to 38, the most significant bit set.
+// The negative powers are rounded up. These are the entries of the Eisel-Lemire tables
+// needed for the floats.
+static const int MIN_POW5 = -65;
+static const int MAX_POW5 = 38;
+static const unsigned long long POW5_128[2 * (MAX_POW5 - MIN_POW5 + 1)] =
 {
-    char* p = str;
-    subStr[0] = str;
-    int figuerIndex = 0;
-    while (*p != '\0')
+    0x86ccbb52ea94baeaULL, 0x98e947129fc2b4e9ULL,
+    0xa87fea27a539e9a5ULL, 0x3f2398d747b36224ULL,
+    0xd29fe4b18e88640eULL, 0x8eec7f0d19a03aadULL,
+    0x83a3eeeef9153e89ULL, 0x1953cf68300424acULL,
+    0xa48ceaaab75a8e2bULL, 0x5fa8c3423c052dd7ULL,
+    0xcdb02555653131b6ULL, 0x3792f412cb06794dULL,
+    0x808e17555f3ebf11ULL, 0xe2bbd88bbee40bd0ULL,
+    0xa0b19d2ab70e6ed6ULL, 0x5b6aceaeae9d0ec4ULL,
+    0xc8de047564d20a8bULL, 0xf245825a5a445275ULL,
+    0xfb158592be068d2eULL, 0xeed6e2f0f0d56712ULL,
+    0x9ced737bb6c4183dULL, 0x55464dd69685606bULL,
+    0xc428d05aa4751e4cULL, 0xaa97e14c3c26b886ULL,
+    0xf53304714d9265dfULL, 0xd53dd99f4b3066a8ULL,
+    0x993fe2c6d07b7fabULL, 0xe546a8038efe4029ULL,
+    0xbf8fdb78849a5f96ULL, 0xde98520472bdd033ULL,
+    0xef73d256a5c0f77cULL, 0x963e66858f6d4440ULL,
+    0x95a8637627989aadULL, 0xdde7001379a44aa8ULL,
+    0xbb127c53b17ec159ULL, 0x5560c018580d5d52ULL,
+    0xe9d71b689dde71afULL, 0xaab8f01e6e10b4a6ULL,
+    0x9226712162ab070dULL, 0xcab3961304ca70e8ULL,
+    0xb6b00d69bb55c8d1ULL, 0x3d607b97c5fd0d22ULL,
+    0xe45c10c42a2b3b05ULL, 0x8cb89a7db77c506aULL,
+    0x8eb98a7a9a5b04e3ULL, 0x77f3608e92adb242ULL,
+    0xb267ed1940f1c61cULL, 0x55f038b237591ed3ULL,
+    0xdf01e85f912e37a3ULL, 0x6b6c46dec52f6688ULL,
+    0x8b61313bbabce2c6ULL, 0x2323ac4b3b3da015ULL,
+    0xae397d8aa96c1b77ULL, 0xabec975e0a0d081aULL,
+    0xd9c7dced53c72255ULL, 0x96e7bd358c904a21ULL,
+    0x881cea14545c7575ULL, 0x7e50d64177da2e54ULL,
+    0xaa242499697392d2ULL, 0xdde50bd1d5d0b9e9ULL,
+    0xd4ad2dbfc3d07787ULL, 0x955e4ec64b44e864ULL,
+    0x84ec3c97da624ab4ULL, 0xbd5af13bef0b113eULL,
+    0xa6274bbdd0fadd61ULL, 0xecb1ad8aeacdd58eULL,
+    0xcfb11ead453994baULL, 0x67de18eda5814af2ULL,
+    0x81ceb32c4b43fcf4ULL, 0x80eacf948770ced7ULL,
+    0xa2425ff75e14fc31ULL, 0xa1258379a94d028dULL,
+    0xcad2f7f5359a3b3eULL, 0x096ee45813a04330ULL,
+    0xfd87b5f28300ca0dULL, 0x8bca9d6e188853fcULL,
+    0x9e74d1b791e07e48ULL, 0x775ea264cf55347eULL,
+    0xc612062576589ddaULL, 0x95364afe032a819eULL,
+    0xf79687aed3eec551ULL, 0x3a83ddbd83f52205ULL,
+    0x9abe14cd44753b52ULL, 0xc4926a9672793543ULL,
+    0xc16d9a0095928a27ULL, 0x75b7053c0f178294ULL,
+    0xf1c90080baf72cb1ULL, 0x5324c68b12dd6339ULL,
+    0x971da05074da7beeULL, 0xd3f6fc16ebca5e04ULL,
+    0xbce5086492111aeaULL, 0x88f4bb1ca6bcf585ULL,
+    0xec1e4a7db69561a5ULL, 0x2b31e9e3d06c32e6ULL,
+    0x9392ee8e921d5d07ULL, 0x3aff322e62439fd0ULL,
+    0xb877aa3236a4b449ULL, 0x09befeb9fad487c3ULL,
+    0xe69594bec44de15bULL, 0x4c2ebe687989a9b4ULL,
+    0x901d7cf73ab0acd9ULL, 0x0f9d37014bf60a11ULL,
+    0xb424dc35095cd80fULL, 0x538484c19ef38c95ULL,
+    0xe12e13424bb40e13ULL, 0x2865a5f206b06fbaULL,
+    0x8cbccc096f5088cbULL, 0xf93f87b7442e45d4ULL,
+    0xafebff0bcb24aafeULL, 0xf78f69a51539d749ULL,
+    0xdbe6fecebdedd5beULL, 0xb573440e5a884d1cULL,
+    0x89705f4136b4a597ULL, 0x31680a88f8953031ULL,
+    0xabcc77118461cefcULL, 0xfdc20d2b36ba7c3eULL,
+    0xd6bf94d5e57a42bcULL, 0x3d32907604691b4dULL,
+    0x8637bd05af6c69b5ULL, 0xa63f9a49c2c1b110ULL,
+    0xa7c5ac471b478423ULL, 0x0fcf80dc33721d54ULL,
+    0xd1b71758e219652bULL, 0xd3c36113404ea4a9ULL,
+    0x83126e978d4fdf3bULL, 0x645a1cac083126eaULL,
+    0xa3d70a3d70a3d70aULL, 0x3d70a3d70a3d70a4ULL,
+    0xccccccccccccccccULL, 0xcccccccccccccccdULL,
+    0x8000000000000000ULL, 0x0000000000000000ULL,
+    0xa000000000000000ULL, 0x0000000000000000ULL,
+    0xc800000000000000ULL, 0x0000000000000000ULL,
+    0xfa00000000000000ULL, 0x0000000000000000ULL,
+    0x9c40000000000000ULL, 0x0000000000000000ULL,
+    0xc350000000000000ULL, 0x0000000000000000ULL,
+    0xf424000000000000ULL, 0x0000000000000000ULL,
+    0x9896800000000000ULL, 0x0000000000000000ULL,
+    0xbebc200000000000ULL, 0x0000000000000000ULL,
+    0xee6b280000000000ULL, 0x0000000000000000ULL,
+    0x9502f90000000000ULL, 0x0000000000000000ULL,
+    0xba43b74000000000ULL, 0x0000000000000000ULL,
+    0xe8d4a51000000000ULL, 0x0000000000000000ULL,
+    0x9184e72a00000000ULL, 0x0000000000000000ULL,
+    0xb5e620f480000000ULL, 0x0000000000000000ULL,
+    0xe35fa931a0000000ULL, 0x0000000000000000ULL,
+    0x8e1bc9bf04000000ULL, 0x0000000000000000ULL,
+    0xb1a2bc2ec5000000ULL, 0x0000000000000000ULL,
+    0xde0b6b3a76400000ULL, 0x0000000000000000ULL,
+    0x8ac7230489e80000ULL, 0x0000000000000000ULL,
+    0xad78ebc5ac620000ULL, 0x0000000000000000ULL,
+    0xd8d726b7177a8000ULL, 0x0000000000000000ULL,
+    0x878678326eac9000ULL, 0x0000000000000000ULL,
+    0xa968163f0a57b400ULL, 0x0000000000000000ULL,
+    0xd3c21bcecceda100ULL, 0x0000000000000000ULL,
+    0x84595161401484a0ULL, 0x0000000000000000ULL,
+    0xa56fa5b99019a5c8ULL, 0x0000000000000000ULL,
+    0xcecb8f27f4200f3aULL, 0x0000000000000000ULL,
+    0x813f3978f8940984ULL, 0x4000000000000000ULL,
+    0xa18f07d736b90be5ULL, 0x5000000000000000ULL,
+    0xc9f2c9cd04674edeULL, 0xa400000000000000ULL,
+    0xfc6f7c4045812296ULL, 0x4d00000000000000ULL,
+    0x9dc5ada82b70b59dULL, 0xf020000000000000ULL,
+    0xc5371912364ce305ULL, 0x6c28000000000000ULL,
+    0xf684df56c3e01bc6ULL, 0xc732000000000000ULL,
+    0x9a130b963a6c115cULL, 0x3c7f400000000000ULL,
+    0xc097ce7bc90715b3ULL, 0x4b9f100000000000ULL,
+    0xf0bdc21abb48db20ULL, 0x1e86d40000000000ULL,
+    0x96769950b50d88f4ULL, 0x1314448000000000ULL
+};
+
+// Powers of ten exact in float.
+static const float POW10F[] =
+{
+    1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+// 128 bit product of a and b.
+inline void multiply64(unsigned long long a, unsigned long long b, unsigned long long& high, unsigned long long& low)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    low = _umul128(a, b, &high);
+#elif defined(__SIZEOF_INT128__)
+    unsigned __int128 product = (unsigned __int128)a * b;
+    high = (unsigned long long)(product >> 64);
+    low = (unsigned long long)product;
+#else
+    unsigned long long aLow = a & 0xFFFFFFFF, aHigh = a >> 32;
+    unsigned long long bLow = b & 0xFFFFFFFF, bHigh = b >> 32;
+    unsigned long long ll = aLow * bLow;
+    unsigned long long lh = aLow * bHigh;
+    unsigned long long hl = aHigh * bLow;
+    unsigned long long hh = aHigh * bHigh;
+    unsigned long long middle = (ll >> 32) + (lh & 0xFFFFFFFF) + (hl & 0xFFFFFFFF);
+    low = (middle << 32) | (ll & 0xFFFFFFFF);
+    high = hh + (lh >> 32) + (hl >> 32) + (middle >> 32);
+#endif
+}
+
+inline int leadingZeros(unsigned long long x)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return 63 - int(index);
+#elif defined(__GNUC__)
+    return __builtin_clzll(x);
+#else
+    int n = 0;
+    while (!(x & 0x8000000000000000ULL))
     {
-        if (*p == ' ' || *p == '\n')
-        {
-            *p = '\0';
-            subStr[++figuerIndex] = p + 1;                        
-        }
-        p++;
+        x <<= 1;
+        ++n;
     }
+    return n;
+#endif
 }
 
-Scalar custom_atof(const char* str)
+// w * 10^q rounded to the nearest float, ties to even, w is not 0.
+// Eisel-Lemire: the product of w and the truncated 5^q gives the bits of the float,
+// and the low bits of the product tell if the value may be halfway between two floats.
+static float eiselLemire(unsigned long long w, int q)
 {
-	char *p = (char *) str;
-
-	// Handle optional sign
-	int negative = 0;
-	switch (*p) 
-	{
-	case '-': negative = 1; // Fall through to increment position
-	case '+': p++;
-	}	
-
-	// Process string of digits
-	Scalar number = 0.;
-	int num_digits = 0;	
-	while (isdigit(*p))
-	{
-		number = number * Scalar(10.) + (*p - '0');
-		p++;
-		num_digits++;
-	}
-
-	// Process decimal part
-	int num_decimals = 0;
-	int exponent = 0;
-	if (*p == '.') 
-	{
-		p++;
-		while (isdigit(*p))
-		{
-			number = number * Scalar(10.) + (*p - '0');
-			p++;
-			num_digits++;
-			num_decimals++;
-		}
+    const int MANTISSA_BITS = 23;
+    const int MIN_EXPONENT = -127;
+    const int INFINITE_POWER = 0xFF;
 
-		exponent -= num_decimals;
-	}
-
-	// Correct for sign
-	if (negative) 
-		number = -number;
+    unsigned int bits = 0;
+    if (q < MIN_POW5)
+    {
+        bits = 0;
+    }
+    else if (q > MAX_POW5)
+    {
+        bits = INFINITE_POWER << MANTISSA_BITS;
+    }
+    else
+    {
+        int lz = leadingZeros(w);
+        w <<= lz;
+
+        // 64 bits are enough unless all the bits below the mantissa and its rounding bits are set.
+        int index = 2 * (q - MIN_POW5);
+        unsigned long long high, low;
+        multiply64(w, POW5_128[index], high, low);
+        const unsigned long long precisionMask = 0xFFFFFFFFFFFFFFFFULL >> (MANTISSA_BITS + 3);
+        if ((high & precisionMask) == precisionMask)
+        {
+            unsigned long long secondHigh, secondLow;
+            multiply64(w, POW5_128[index + 1], secondHigh, secondLow);
+            low += secondHigh;
+            if (secondHigh > low)
+                ++high;
+        }
 
-	// Process an exponent string
-	if (*p == 'e' || *p == 'E') 
-	{
-		// Handle optional sign
-		negative = 0;
-		switch(*++p) 
-		{   
-		  case '-': negative = 1;   // Fall through to increment pos
-		  case '+': p++;
-		}
+        int upperBit = int(high >> 63);
+        int shift = upperBit + 64 - MANTISSA_BITS - 3;
+        unsigned long long mantissa = high >> shift;
+        int power2 = (((152170 + 65536) * q) >> 16) + 63 + upperBit - lz - MIN_EXPONENT;
 
-		// Process string of digits
-		int n = 0;
-		while (isdigit(*p)) 
-		{   
-			n = n * 10 + (*p - '0');
-			p++;
-		}
+        if (power2 <= 0)
+        {
+            // Subnormal.
+            if (-power2 + 1 >= 64)
+            {
+                mantissa = 0;
+                power2 = 0;
+            }
+            else
+            {
+                mantissa >>= -power2 + 1;
+                mantissa += (mantissa & 1);
+                mantissa >>= 1;
+                power2 = (mantissa < (1ULL << MANTISSA_BITS)) ? 0 : 1;
+            }
+        }
+        else
+        {
+            // A halfway value is exact in the product, it rounds to even.
+            if (low <= 1 && q >= -17 && q <= 10 && (mantissa & 3) == 1 && (mantissa << shift) == high)
+                mantissa &= ~1ULL;
+
+            mantissa += (mantissa & 1);
+            mantissa >>= 1;
+            if (mantissa >= (2ULL << MANTISSA_BITS))
+            {
+                mantissa = 1ULL << MANTISSA_BITS;
+                ++power2;
+            }
+            mantissa &= ~(1ULL << MANTISSA_BITS);
+            if (power2 >= INFINITE_POWER)
+            {
+                power2 = INFINITE_POWER;
+                mantissa = 0;
+            }
+        }
 
-		if (negative)
-			exponent -= n;
-		else
-			exponent += n;
-	}
+        bits = (unsigned int)mantissa | ((unsigned int)power2 << MANTISSA_BITS);
+    }
 
-	// Scale the result
-	Scalar p10 = exponent > 0 ? Scalar(10.) : Scalar(0.1);
-	int n = exponent;
-	if (n < 0) 
-		n = -n;
-	while (n) 
-	{
-		if (n & 1) 
-		{
-			number *= p10;
-		}
-		n >>= 1;
-		p10 *= p10;
-	}
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
 
-	return number;
+inline bool isDigit(char c)
+{
+    return (unsigned char)(c - '0') < 10;
 }
 
-int cvt(Scalar arg, int ndigits, int& decpt, int& sign, char* buf)
+const char* ParseScalar(const char* p, const char* end, Scalar& value)
 {
-    decpt = 0;
+    const char* start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = (*p == '-');
+        ++p;
+    }
 
-    // Get the sign.
-    sign = 0;
-    if (arg < 0)
+    // Up to 19 significant digits, w * 10^q is the value.
+    unsigned long long w = 0;
+    int digits = 0;
+    int q = 0;
+    bool anyDigit = false;
+    bool truncated = false;
+    while (p < end && isDigit(*p))
     {
-        sign = 1;
-        arg = -arg;
+        anyDigit = true;
+        if (digits < 19)
+        {
+            w = w * 10 + (*p - '0');
+            if (w != 0)
+                ++digits;
+        }
+        else
+        {
+            ++q;
+            truncated = truncated || *p != '0';
+        }
+        ++p;
     }
 
-    // Split the Scalar into integral part and fraction part.
-    Scalar frac = 0;
-    Scalar intg = 0;
-    frac = modf(arg, &intg);
-        
-    char* p = &buf[CVTBUFSIZE];
-    char* q = buf;
-    if (intg != 0) 
-    {        
-        // Convert the integral part to string if integral part isn't 0.
-        // First, put the string at the end of the buffer.
-        // Because the digit is fetched from low to high, 
-        // and the end position is not determined yet.
-        p = &buf[CVTBUFSIZE];
-        while (intg != 0) 
+    if (p < end && *p == '.')
+    {
+        ++p;
+        while (p < end && isDigit(*p))
         {
-            Scalar digit = modf(intg / 10, &intg);
-            *--p = char((int)((digit + .03) * 10) + '0');
-            decpt++;
+            anyDigit = true;
+            if (digits < 19)
+            {
+                w = w * 10 + (*p - '0');
+                if (w != 0)
+                    ++digits;
+                --q;
+            }
+            else
+            {
+                truncated = truncated || *p != '0';
+            }
+            ++p;
         }
+    }
 
-        // After the conversion, copy to the start of the buffer.
-        q = buf;
-        while (p < &buf[CVTBUFSIZE])
-            *q++ = *p++;
-    } 
-    else if (frac > 0)
+    if (anyDigit && p < end && (*p == 'e' || *p == 'E'))
     {
-        // If < 1, skip the non-significant 0 of the fraction part.
-        Scalar temp;
-        while ((temp = frac * 10) < 1) 
+        const char* e = p + 1;
+        bool negativeExponent = false;
+        if (e < end && (*e == '-' || *e == '+'))
+        {
+            negativeExponent = (*e == '-');
+            ++e;
+        }
+        if (e < end && isDigit(*e))
         {
-            frac = temp;
-            decpt--;
+            int exponent = 0;
+            while (e < end && isDigit(*e))
+            {
+                if (exponent < 100000)
+                    exponent = exponent * 10 + (*e - '0');
+                ++e;
+            }
+            q += negativeExponent ? -exponent : exponent;
+            p = e;
         }
     }
 
-    // Convert the fraction part to string.
-    while (q <= &buf[ndigits])
+    // inf and nan, or more digits than w holds, go to strtof. It needs a copy,
+    // the text does not end after the number.
+    if (!anyDigit || truncated)
     {
-        frac *= 10;
-        frac = modf(frac, &intg);
-        *q++ = char((int)intg + '0');
-    }    
+        size_t length = truncated ? size_t(p - start) : 0;
+        while (!truncated && start + length < end && length < 16 && !isspace((unsigned char)start[length]))
+            ++length;
+
+        char shortToken[BUFSIZE];
+        char* token = (length < size_t(BUFSIZE)) ? shortToken : new char[length + 1];
+        memcpy(token, start, length);
+        token[length] = '\0';
+
+        char* tokenEnd;
+        Scalar number = strtof(token, &tokenEnd);
+        const char* next = start + (tokenEnd - token);
+        if (token != shortToken)
+            delete [] token;
+
+        if (next == start)
+            return start;
+        value = number;
+        return next;
+    }
 
-    // Round.
-	q = &buf[ndigits];
-	*q += 5;
-	while (*q > '9') 
-	{
-		*q = '0';
-		if (q > buf)
-			++(*--q);
-		else 
-		{
-			*q = '1';
-			decpt++;
-		}
-	}
+    Scalar result;
+    if (w == 0)
+        result = 0.0f;
+    else if (q >= -10 && q <= 10 && w <= (1ULL << 24))
+    {
+        // Both operands are exact, the one rounding is the right one.
+        result = (q < 0) ? Scalar(w) / POW10F[-q] : Scalar(w) * POW10F[q];
+    }
+    else
+        result = eiselLemire(w, q);
 
-	// Eliminate 0 at the end.
-	q = &buf[ndigits - 1];
-	while (*q == '0' && q-- > buf);
-    *(++q)= '\0';
+    value = negative ? -result : result;
+    return p;
+}
 
-    return int(q - buf);
+inline int lowestBit(unsigned int mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return int(index);
+#elif defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int n = 0;
+    while (!(mask & 1))
+    {
+        mask >>= 1;
+        ++n;
+    }
+    return n;
+#endif
 }
 
-int Scalar2str_g(Scalar arg, char* buf)
+const char* FindNewline(const char* p, const char* end)
 {
-	if (arg == 0)
-	{
-		buf[0] = '0';
-		buf[1] = '\0';
-		return 1;
-	}
+#if SIMD_SCAN
+    // 16 bytes at a time.
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        if (mask != 0)
+            return p + lowestBit(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '\n')
+        ++p;
+    return p;
+}
 
-	// Get significant digits.
-	char cvtBuf[CVTBUFSIZE];
-	int decpt = 0;
-	int sign = 0;
-	int len = cvt(arg, 6, decpt, sign, cvtBuf);
+// A line is empty if it starts with its end.
+inline bool emptyLine(const char* line, const char* end)
+{
+    return line == end || *line == '\n' || *line == '\r';
+}
 
-	// Get real buf.
-	char* p = cvtBuf;
-	char* q = buf;
-	if (decpt < -4 || decpt > 6)
-	{
-		// Scientific.		
-		if (sign == 1)
-		{
-			*q++ = '-';
-		}
+int CountTextLines(const char* begin, const char* end)
+{
+    int lines = 0;
+    const char* line = begin;
+#if SIMD_SCAN
+    // Every newline of a block ends a line.
+    const __m128i newline = _mm_set1_epi8('\n');
+    const char* p = begin;
+    while (end - p >= 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        while (mask != 0)
+        {
+            const char* lineEnd = p + lowestBit(mask);
+            if (!emptyLine(line, lineEnd))
+                ++lines;
+            line = lineEnd + 1;
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+#endif
+    while (line < end)
+    {
+        const char* lineEnd = FindNewline(line, end);
+        if (!emptyLine(line, lineEnd))
+            ++lines;
+        line = lineEnd + 1;
+    }
+    return lines;
+}
 
-		// First digit and dot.
-		*q++ = *p++;
-		if (p < cvtBuf + len)
-		{
-			*q++ = '.';
-		}
+inline const char* skipBlanks(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        ++p;
+    return p;
+}
 
-		// Copy the next digits.
-		while (p < cvtBuf + len)
-		{
-			*q++ = *p++;
-		}
+int ParseTextLines(const char* begin, const char* end, Scalar* values)
+{
+    int n = 0;
+    const char* p = begin;
+    while (p < end)
+    {
+        if (emptyLine(p, end))
+        {
+            p = FindNewline(p, end) + 1;
+            continue;
+        }
 
-		// E.
-		*q++ = 'e';
+        for (int i = 0; i < 3; ++i)
+        {
+            p = skipBlanks(p, end);
+            const char* next = ParseScalar(p, end, values[n]);
+            if (next == p)
+                return -1;
+            p = next;
+            ++n;
+        }
 
-		// Exponential.
-		int exp = decpt - 1;
-		if (exp < 0)
-		{
-			*q++ = '-';
-			exp = -exp;
-		}
-		p = &buf[BUFSIZE];
-		while (exp > 0)
-		{
-			*(--p) = exp % 10 + '0';
-			exp /= 10;
-		}
-		while (p < buf + BUFSIZE)
-			*q++ = *p++;
-        
-		*q = '\0';
-	}
-	else
-	{
-		if (sign == 1)
-		{
-			*q++ = '-';
-		}
+        p = skipBlanks(p, end);
+        if (p < end && *p != '\n')
+            return -1;
+        ++p;
+    }
+    return n;
+}
 
-		// Get the integral part.
-		if (decpt <= 0)
-		{
-			*q++ = '0';
-		}
-		else
-		{
-			for (int i = 0; i < decpt; ++i)
-				*q++ = *p++;
-		}
+// 10^(5 - k) for the decimal exponents k of the floats, from -46 to 39.
+// A float scaled by it lies in [1e5, 1e6) when k is its exponent.
+static const int MIN_EXP10 = -46;
+static const int MAX_EXP10 = 39;
+static const double SCALE_POW10[MAX_EXP10 - MIN_EXP10 + 1] =
+{
+    1e51, 1e50, 1e49, 1e48, 1e47, 1e46, 1e45, 1e44,
+    1e43, 1e42, 1e41, 1e40, 1e39, 1e38, 1e37, 1e36,
+    1e35, 1e34, 1e33, 1e32, 1e31, 1e30, 1e29, 1e28,
+    1e27, 1e26, 1e25, 1e24, 1e23, 1e22, 1e21, 1e20,
+    1e19, 1e18, 1e17, 1e16, 1e15, 1e14, 1e13, 1e12,
+    1e11, 1e10, 1e9, 1e8, 1e7, 1e6, 1e5, 1e4,
+    1e3, 1e2, 1e1, 1e0, 1e-1, 1e-2, 1e-3, 1e-4,
+    1e-5, 1e-6, 1e-7, 1e-8, 1e-9, 1e-10, 1e-11, 1e-12,
+    1e-13, 1e-14, 1e-15, 1e-16, 1e-17, 1e-18, 1e-19, 1e-20,
+    1e-21, 1e-22, 1e-23, 1e-24, 1e-25, 1e-26, 1e-27, 1e-28,
+    1e-29, 1e-30, 1e-31, 1e-32, 1e-33, 1e-34
+};
+
+inline double scalePow10(double x, int k)
+{
+    return x * SCALE_POW10[k - MIN_EXP10];
+}
 
-		// Dot.
-		if (p < cvtBuf + len)
-		{
-			*q++ = '.';
-		}
+// Round |arg| to 6 significant digits, digits gets them in [100000, 999999] and exp10 the
+// decimal exponent of the first one. The float is exact in double and the scaling is off
+// by a few ulps at most, so only a value within 1e-6 of a halfway point can be rounded
+// the wrong way, false is returned for these and the caller falls back to printf.
+inline bool roundDigits6(double arg, int& digits, int& exp10)
+{
+    // Estimate of floor(log10(arg)) from the binary exponent, then corrected.
+    // The floats, subnormal ones included, are normal doubles.
+    unsigned long long bits;
+    memcpy(&bits, &arg, sizeof(bits));
+    int exp2 = int((bits >> 52) & 0x7FF) - 1023;
+    int k = (exp2 * 78913) >> 18;
+
+    double scaled = scalePow10(arg, k);
+    if (scaled >= 1e6)
+    {
+        ++k;
+        scaled = scalePow10(arg, k);
+    }
+    else if (scaled < 1e5)
+    {
+        --k;
+        scaled = scalePow10(arg, k);
+    }
+
+    int n = int(scaled);
+    double frac = scaled - n;
+    if (frac > 0.5 - 1e-6 && frac < 0.5 + 1e-6)
+        return false;
+    if (frac > 0.5)
+        ++n;
+    if (n == 1000000)
+    {
+        n = 100000;
+        ++k;
+    }
+
+    digits = n;
+    exp10 = k;
+    return true;
+}
+
+// Same text as printf("%g"): 6 significant digits, no trailing zeros, the exponent has
+// at least 2 digits.
+int Scalar2str_g(Scalar arg, char* buf)
+{
+    double value = arg;
+    char* q = buf;
 
-		// Get the fraction part.
-		for (int i = 0; i > decpt; --i)
-			*q++ = '0';
-		while (p < cvtBuf + len)
-			*q++ = *p++;
+    if (value != value || value - value != 0.0)
+        return sprintf_s(buf, BUFSIZE, "%g", value);
 
+    if (value < 0.0 || (value == 0.0 && 1.0 / value < 0.0))
+    {
+        *q++ = '-';
+        value = -value;
+    }
+
+    if (value == 0.0)
+    {
+        *q++ = '0';
         *q = '\0';
-	}
+        return int(q - buf);
+    }
+
+    int n, k;
+    if (!roundDigits6(value, n, k))
+        return sprintf_s(buf, BUFSIZE, "%g", double(arg));
+
+    // The 6 digits, then drop the trailing zeros.
+    char digits[6];
+    for (int i = 5; i >= 0; --i)
+    {
+        digits[i] = char('0' + n % 10);
+        n /= 10;
+    }
+    int len = 6;
+    while (digits[len - 1] == '0')
+        --len;
+
+    if (k < -4 || k >= 6)
+    {
+        // Scientific.
+        *q++ = digits[0];
+        if (len > 1)
+        {
+            *q++ = '.';
+            for (int i = 1; i < len; ++i)
+                *q++ = digits[i];
+        }
+
+        *q++ = 'e';
+        if (k < 0)
+        {
+            *q++ = '-';
+            k = -k;
+        }
+        else
+        {
+            *q++ = '+';
+        }
+        if (k >= 10)
+            *q++ = char('0' + k / 10);
+        else
+            *q++ = '0';
+        *q++ = char('0' + k % 10);
+    }
+    else if (k >= 0)
+    {
+        // Integral part, then the fraction if any digit is left.
+        int i = 0;
+        for (; i <= k; ++i)
+            *q++ = i < len ? digits[i] : '0';
+        if (i < len)
+        {
+            *q++ = '.';
+            for (; i < len; ++i)
+                *q++ = digits[i];
+        }
+    }
+    else
+    {
+        // Below 1, zeros after the dot first.
+        *q++ = '0';
+        *q++ = '.';
+        for (int i = -1; i > k; --i)
+            *q++ = '0';
+        for (int i = 0; i < len; ++i)
+            *q++ = digits[i];
+    }
 
-	return int(q - buf);
+    *q = '\0';
+    return int(q - buf);
 }
 
 int vertex2str_g(Scalar* vertex, char* buf)
@@ -300,4 +687,276 @@ int vertex2str_g(Scalar* vertex, char* buf)
     *p++ = '\n';
     *p = '\0';
     return int(p - buf);
-}
\ No newline at end of file
+}
+
+int FormatHitLines(const HitRecord* hits, int num, const BasicRay* rays, char* buf)
+{
+    char* p = buf;
+    for (int i = 0; i < num; ++i)
+    {
+        const BasicRay& bray = rays[hits[i].rayId];
+        F3d intPt = bray.original + hits[i].t * bray.direction;
+#if CUSTOM_OUT
+        p += vertex2str_g(&intPt.x, p);
+#else
+        p += sprintf_s(p, MAX_HIT_LINE, "%g %g %g\r\n", intPt.x, intPt.y, intPt.z);
+#endif
+    }
+    return int(p - buf);
+}
+
+int FormatHits(const HitRecord* hits, int num, const BasicRay* rays, long long firstRay, HitFormat format, char* buf)
+{
+    if (format == HIT_TEXT)
+        return FormatHitLines(hits, num, rays, buf);
+
+    if (format == HIT_BINARY)
+    {
+        BasicHit* records = (BasicHit*)buf;
+        for (int i = 0; i < num; ++i)
+        {
+            const BasicRay& bray = rays[hits[i].rayId];
+            records[i].point = bray.original + hits[i].t * bray.direction;
+        }
+        return num * int(sizeof(BasicHit));
+    }
+
+    BasicHitWithId* records = (BasicHitWithId*)buf;
+    for (int i = 0; i < num; ++i)
+    {
+        const BasicRay& bray = rays[hits[i].rayId];
+        records[i].rayId = (unsigned int)(firstRay + hits[i].rayId);
+        records[i].triId = hits[i].triId;
+        records[i].point = bray.original + hits[i].t * bray.direction;
+    }
+    return num * int(sizeof(BasicHitWithId));
+}
+
+int FormatHitHeader(unsigned int num, HitFormat format, char* buf)
+{
+    if (format == HIT_TEXT)
+        return sprintf_s(buf, BUFSIZE, "%u\r\n", num);
+
+    memcpy(buf, &num, sizeof(num));
+    return int(sizeof(num));
+}
+
+#ifdef _WIN32
+OutputFile::OutputFile()
+    : mHandle(INVALID_HANDLE_VALUE)
+{
+}
+
+bool OutputFile::Open(const char* filename)
+{
+    mHandle = CreateFileA(filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    return mHandle != INVALID_HANDLE_VALUE;
+}
+
+bool OutputFile::WriteAt(const char* data, size_t size, long long offset) const
+{
+    // A synchronous handle still writes at the offset of the overlapped structure.
+    while (size > 0)
+    {
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = DWORD(offset & 0xFFFFFFFF);
+        overlapped.OffsetHigh = DWORD(offset >> 32);
+
+        DWORD piece = (size > 0x40000000) ? 0x40000000 : DWORD(size);
+        DWORD written = 0;
+        if (!WriteFile(mHandle, data, piece, &written, &overlapped) || written == 0)
+            return false;
+
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+void OutputFile::Close()
+{
+    if (mHandle != INVALID_HANDLE_VALUE)
+        CloseHandle(mHandle);
+    mHandle = INVALID_HANDLE_VALUE;
+}
+#else
+OutputFile::OutputFile()
+    : mFile(-1)
+{
+}
+
+bool OutputFile::Open(const char* filename)
+{
+    mFile = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return mFile >= 0;
+}
+
+bool OutputFile::WriteAt(const char* data, size_t size, long long offset) const
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(mFile, data, size, off_t(offset));
+        if (written <= 0)
+            return false;
+
+        data += written;
+        size -= size_t(written);
+        offset += written;
+    }
+    return true;
+}
+
+void OutputFile::Close()
+{
+    if (mFile >= 0)
+        close(mFile);
+    mFile = -1;
+}
+#endif
+
+OutputFile::~OutputFile()
+{
+    Close();
+}
+
+#ifdef _WIN32
+MappedFile::MappedFile()
+    : mHandle(INVALID_HANDLE_VALUE)
+    , mMapping(NULL)
+    , mData(NULL)
+    , mSize(0)
+{
+}
+
+bool MappedFile::Open(const char* filename)
+{
+    mHandle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (mHandle == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(mHandle, &size) || size.QuadPart == 0)
+    {
+        Close();
+        return false;
+    }
+    mSize = size_t(size.QuadPart);
+
+    mMapping = CreateFileMappingA(mHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mMapping != NULL)
+        mData = (const char*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+    if (mData == NULL)
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (mData != NULL)
+        UnmapViewOfFile(mData);
+    if (mMapping != NULL)
+        CloseHandle(mMapping);
+    if (mHandle != INVALID_HANDLE_VALUE)
+        CloseHandle(mHandle);
+    mHandle = INVALID_HANDLE_VALUE;
+    mMapping = NULL;
+    mData = NULL;
+    mSize = 0;
+}
+#else
+MappedFile::MappedFile()
+    : mFile(-1)
+    , mData(NULL)
+    , mSize(0)
+{
+}
+
+bool MappedFile::Open(const char* filename)
+{
+    mFile = open(filename, O_RDONLY);
+    if (mFile < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(mFile, &info) != 0 || info.st_size == 0)
+    {
+        Close();
+        return false;
+    }
+    mSize = size_t(info.st_size);
+
+    void* data = mmap(NULL, mSize, PROT_READ, MAP_PRIVATE, mFile, 0);
+    if (data == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+    madvise(data, mSize, MADV_SEQUENTIAL);
+    mData = (const char*)data;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (mData != NULL)
+        munmap((void*)mData, mSize);
+    if (mFile >= 0)
+        close(mFile);
+    mFile = -1;
+    mData = NULL;
+    mSize = 0;
+}
+#endif
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+void RadixSortOrder(const unsigned int* keys, int num, int* order)
+{
+	for (int i = 0; i < num; ++i)
+		order[i] = i;
+	if (num < 2)
+		return;
+
+	// Least significant byte first, every pass is stable.
+	int* source = order;
+	int* target = new int[num];
+	for (int shift = 0; shift < 32; shift += 8)
+	{
+		int count[257] = {0};
+		for (int i = 0; i < num; ++i)
+			++count[((keys[i] >> shift) & 0xFF) + 1];
+
+		// All the keys have the same digit, the pass would not move anything.
+		if (count[((keys[0] >> shift) & 0xFF) + 1] == num)
+			continue;
+
+		for (int i = 0; i < 256; ++i)
+			count[i + 1] += count[i];
+
+		for (int i = 0; i < num; ++i)
+		{
+			int index = source[i];
+			target[count[(keys[index] >> shift) & 0xFF]++] = index;
+		}
+
+		int* swap = source;
+		source = target;
+		target = swap;
+	}
+
+	if (source != order)
+	{
+		for (int i = 0; i < num; ++i)
+			order[i] = source[i];
+		target = source;
+	}
+	delete [] target;
+}
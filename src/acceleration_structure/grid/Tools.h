@@ -4,24 +4,105 @@
 #include <math.h>
 #include <stdlib.h>
 
-const int CVTBUFSIZE = 128;
 const int BUFSIZE = 32;
 
-void SubdivideVertexStr(char* str, char* subStr[]);
+// Parse the number at p, the text ends at end. The value is correctly rounded, like strtof.
+// Returns the end of the number, p if there is none.
+const char* ParseScalar(const char* p, const char* end, Scalar& value);
 
-Scalar custom_atof(const char* str);
+// Text inputs, a count line then one "x y z" line per vertex, empty lines are skipped.
+// First newline from p, end if there is none.
+const char* FindNewline(const char* p, const char* end);
 
-inline Scalar Atof(const char* str)
-{
-#if CUSTOM_IN
-    return custom_atof(str);
-#else    
-    return atof(str);
-#endif
-}
+// Lines that are not empty from begin to end.
+int CountTextLines(const char* begin, const char* end);
 
+// Parse the three numbers of each line from begin to end into values.
+// Returns the number of values, -1 if a line is not three numbers.
+int ParseTextLines(const char* begin, const char* end, Scalar* values);
+
+// Same text as printf("%g"), the buffer needs BUFSIZE bytes. Returns the length of the text.
 int Scalar2str_g(Scalar arg, char* buf);
 
+// The three coordinates as "x y z\r\n".
 int vertex2str_g(Scalar* vertex, char* buf);
 
+struct HitRecord;
+struct BasicRay;
+
+// Room for the line or the record of one hit.
+const int MAX_HIT_LINE = 64;
+
+// Output of the hits: "x y z\r\n" lines, or packed BasicHit or BasicHitWithId records
+// after a count, in the byte order of the .bin inputs.
+enum HitFormat
+{
+    HIT_TEXT,
+    HIT_BINARY,
+    HIT_BINARY_IDS
+};
+
+// Format the points of the hits, one "x y z\r\n" line each, rays holds the rays of the hit
+// ids. The buffer needs num * MAX_HIT_LINE bytes, returns the length of the text.
+int FormatHitLines(const HitRecord* hits, int num, const BasicRay* rays, char* buf);
+
+// Same as FormatHitLines in the given format, returns the length of the data. firstRay is the
+// input index of rays[0], the ray ids of the records are counted from it.
+int FormatHits(const HitRecord* hits, int num, const BasicRay* rays, long long firstRay, HitFormat format, char* buf);
+
+// The hit count that starts the output, returns its length.
+int FormatHitHeader(unsigned int num, HitFormat format, char* buf);
+
+// Output file written by pieces at given offsets, from several threads at once.
+class OutputFile
+{
+public:
+    OutputFile();
+
+    ~OutputFile();
+
+    bool Open(const char* filename);
+
+    bool WriteAt(const char* data, size_t size, long long offset) const;
+
+    void Close();
+
+private:
+#ifdef _WIN32
+    void*   mHandle;
+#else
+    int     mFile;
+#endif
+};
+
+// Input file mapped read only, its data is used in place.
+class MappedFile
+{
+public:
+    MappedFile();
+
+    ~MappedFile();
+
+    bool Open(const char* filename);
+
+    const char* Data() const { return mData; }
+
+    size_t Size() const { return mSize; }
+
+    void Close();
+
+private:
+#ifdef _WIN32
+    void*   mHandle;
+    void*   mMapping;
+#else
+    int     mFile;
+#endif
+    const char* mData;
+    size_t  mSize;
+};
+
+// Stable order of the keys by radix sort, order gets the num indices of the sorted keys.
+void RadixSortOrder(const unsigned int* keys, int num, int* order);
+
 #endif
\ No newline at end of file
@@ -2,9 +2,9 @@
 #define _COMMON_H_
 
 #define PARALLEL 1
-#define PARSE_INSIDE 1
+#define PARALLEL_BUILD 1
+#define COMPACT_CELLS 1
 #define CUSTOM_OUT 1
-#define CUSTOM_IN 1
 
 typedef float Scalar;
 
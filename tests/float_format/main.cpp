@@ -0,0 +1,85 @@
+// Check Scalar2str_g against printf("%g") over float bit patterns, every one of the 2^32
+// by default, or one in step of them. A few of the differences are printed.
+//
+
+#include "Common.h"
+#include "Tools.h"
+
+// tbb includes
+#include "parallel_reduce.h"
+#include "blocked_range.h"
+
+// system include.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Differences printed at most.
+const int MAX_PRINTED = 20;
+
+// Count the bit patterns of the range where the two texts differ, pattern i is i * step.
+class CompareFormatTask
+{
+public:
+    long long mStep;
+    long long mChecked;
+    long long mDifferent;
+
+public:
+    CompareFormatTask(long long step)
+        : mStep(step)
+        , mChecked(0)
+        , mDifferent(0)
+    {}
+    CompareFormatTask(CompareFormatTask& task, tbb::split)
+        : mStep(task.mStep)
+        , mChecked(0)
+        , mDifferent(0)
+    {}
+    void operator()(const tbb::blocked_range<long long>& r)
+    {
+        char expected[BUFSIZE];
+        char text[BUFSIZE];
+        for (long long i = r.begin(); i != r.end(); ++i)
+        {
+            unsigned int bits = (unsigned int)(i * mStep);
+            Scalar value;
+            memcpy(&value, &bits, sizeof(value));
+
+            int expectedLength = sprintf_s(expected, BUFSIZE, "%g", double(value));
+            int length = Scalar2str_g(value, text);
+            if (length != expectedLength || strcmp(text, expected) != 0)
+            {
+                if (mDifferent < MAX_PRINTED)
+                    printf("0x%08x: \"%s\" instead of \"%s\"\n", bits, text, expected);
+                ++mDifferent;
+            }
+        }
+        mChecked += r.end() - r.begin();
+    }
+    void join(const CompareFormatTask& task)
+    {
+        mChecked += task.mChecked;
+        mDifferent += task.mDifferent;
+    }
+};
+
+int main(int argc, char* argv[])
+{
+    long long step = 1;
+    if (argc > 1)
+        step = atoll(argv[1]);
+    if (step < 1 || step > 0xFFFFFFFFLL)
+    {
+        printf("Usage: float_format.exe [step]\n");
+        return 0;
+    }
+
+    long long count = (0x100000000LL + step - 1) / step;
+    CompareFormatTask task(step);
+    tbb::parallel_reduce(tbb::blocked_range<long long>(0, count, 1 << 16), task);
+
+    printf("%lld floats checked, %lld different.\n", task.mChecked, task.mDifferent);
+
+    return (task.mDifferent == 0) ? 0 : 1;
+}
@@ -0,0 +1,92 @@
+// Convert the binary hit output of ray_triangle_intersect (out=bin or out=bin_ids)
+// to its text format, so it can be compared with the expected outputs.
+//
+
+#include "Common.h"
+#include "Geometry.h"
+#include "Tools.h"
+
+// system include.
+#include <stdio.h>
+#include <string.h>
+
+// Points converted at a time.
+const int CHUNK_POINTS = 4096;
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        printf("Usage: hit_to_text.exe hits.bin output.txt\n");
+        return 0;
+    }
+
+    // Mapped, so the size is right past 2 GB and no read can come short.
+    MappedFile input;
+    if (!input.Open(argv[1])) {
+        printf("Can't open %s.\n", argv[1]);
+        return -1;
+    }
+
+    // The record size follows from the file size, the ids are there or not.
+    unsigned int numOfHits = 0;
+    if (input.Size() >= sizeof(numOfHits))
+        memcpy(&numOfHits, input.Data(), sizeof(numOfHits));
+    long long dataSize = (long long)input.Size() - (long long)sizeof(numOfHits);
+
+    int recordSize;
+    if (dataSize >= 0 && (numOfHits == 0 || dataSize == (long long)numOfHits * (long long)sizeof(BasicHit)))
+        recordSize = sizeof(BasicHit);
+    else if (dataSize == (long long)numOfHits * (long long)sizeof(BasicHitWithId))
+        recordSize = sizeof(BasicHitWithId);
+    else
+    {
+        printf("%s is not a binary hit file.\n", argv[1]);
+        return -1;
+    }
+    const char* records = input.Data() + sizeof(numOfHits);
+
+    FILE *fp2 = NULL;
+    fopen_s(&fp2, argv[2], "wb");
+    if (fp2 == NULL) {
+        printf("Can't open %s.\n", argv[2]);
+        return -1;
+    }
+
+    char header[BUFSIZE];
+    int headerLength = FormatHitHeader(numOfHits, HIT_TEXT, header);
+    bool written = (fwrite(header, 1, headerLength, fp2) == size_t(headerLength));
+
+    char* text = new char[CHUNK_POINTS * MAX_HIT_LINE];
+    for (long long first = 0; written && first < numOfHits; first += CHUNK_POINTS)
+    {
+        int count = (numOfHits - first < CHUNK_POINTS) ? int(numOfHits - first) : CHUNK_POINTS;
+        const char* chunk = records + first * recordSize;
+
+        char* p = text;
+        for (int i = 0; i < count; ++i)
+        {
+            F3d point;
+            if (recordSize == sizeof(BasicHit))
+                point = ((const BasicHit*)chunk)[i].point;
+            else
+                point = ((const BasicHitWithId*)chunk)[i].point;
+#if CUSTOM_OUT
+            p += vertex2str_g(&point.x, p);
+#else
+            p += sprintf_s(p, MAX_HIT_LINE, "%g %g %g\r\n", point.x, point.y, point.z);
+#endif
+        }
+        written = (fwrite(text, 1, p - text, fp2) == size_t(p - text));
+    }
+
+    delete[] text;
+    if (fclose(fp2) != 0)
+        written = false;
+    if (!written) {
+        printf("Can't write %s.\n", argv[2]);
+        return -1;
+    }
+
+    return 0;
+}
@@ -4,7 +4,12 @@
 #include "Common.h"
 #include "Geometry.h"
 #include "Grid.h"
+#include "Bvh.h"
+#include "SimdKernel.h"
 #include "Tools.h"
+#include "RayStream.h"
+#include "Stats.h"
+#include "PerfCounters.h"
 
 // tbb includes
 #include "ParallelTask.h"
@@ -16,10 +21,11 @@
 #include <time.h>
 #include <windows.h>
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
-#include <sys/types.h>
-#include <sys/stat.h>
+#include <limits.h>
+#include <string.h>
 
 using namespace std;
 
@@ -28,22 +34,130 @@ using namespace std;
 
 const Scalar CONFINEMENT = 1000.0f;
 
-#if !PARALLEL
-void computeIntersections(Grid& grid, int numOfRays, Ray* rays, List<F3d>& intersectPoints);
+// Bytes of text parsed by one task.
+const int TEXT_CHUNK_SIZE = 1 << 20;
+
+#if PARALLEL
+size_t computeIntersectionsParallel(Accelerator* scene, int numOfRays, Ray* rays, List<HitRecord>& hitRecords);
+#else
+size_t computeIntersections(Accelerator& scene, int numOfRays, Ray* rays, List<HitRecord>& hitRecords);
 #endif
 
-void RayPreCompute(Ray& ray, const Grid& grid);
+Ray* SortRays(Ray* rays, int numOfRays, const Box& box);
+
+bool writeHits(const char* outputFile, const List<HitRecord>& hitRecords, const BasicRay* rays, HitFormat format);
 
-void* FileRead(const char* filename, int interval, std::vector<char*>& outList, unsigned int& numberOfGeom);
+bool streamHits(const char* rayFile, const Accelerator* scene, const char* outputFile, HitFormat format, unsigned int& numOfRays);
+
+bool isTextInput(const char* filename);
+
+void reportCounters(const List<PhaseCounters>& phases, long long rays, StatsReport& report);
+
+Scalar* readTextInput(const MappedFile& input, int linesPerRecord, unsigned int& count);
 
 int main(int argc, char* argv[])
 {
-    if (argc != 4)
+    if (argc < 4)
     {
-        printf("Usage: ContestSample.exe geometry_input.txt ray_input.txt output.txt\n");
+        printf("Usage: ContestSample.exe geometry_input.txt ray_input.txt output.txt [grid|grid2|bvh] [auto] [sat] [packet] [mailbox] [skip] [sort] [closest|any|first=K] [kernel=scalar|sse|avx2|avx512] [out=text|bin|bin_ids] [stream] [stats=report.json] [perf]\n");
         return 0;
     }
 
+    // Acceleration structure, the grid by default, and its build options.
+    bool useBvh = false;
+    bool sortRays = false;
+    bool streamRays = false;
+    HitFormat hitFormat = HIT_TEXT;
+    const char* statsFile = NULL;
+    bool countPerf = false;
+    for (int i = 4; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "bvh") == 0)
+            useBvh = true;
+        else if (strcmp(argv[i], "grid2") == 0)
+            Grid::TWO_LEVEL = true;
+        else if (strcmp(argv[i], "auto") == 0)
+            Grid::AUTO_RESOLUTION = true;
+        else if (strcmp(argv[i], "sat") == 0)
+            Grid::EXACT_OVERLAP = true;
+        else if (strcmp(argv[i], "packet") == 0)
+            Grid::PACKET_TRAVERSAL = true;
+        else if (strcmp(argv[i], "mailbox") == 0)
+            Grid::MAILBOXING = true;
+        else if (strcmp(argv[i], "skip") == 0)
+            Grid::EMPTY_SPACE_SKIPPING = true;
+        else if (strcmp(argv[i], "sort") == 0)
+            sortRays = true;
+        else if (strcmp(argv[i], "stream") == 0)
+            streamRays = true;
+        else if (strcmp(argv[i], "closest") == 0)
+            Grid::QUERY = QUERY_CLOSEST;
+        else if (strcmp(argv[i], "any") == 0)
+            Grid::QUERY = QUERY_ANY;
+        else if (strncmp(argv[i], "first=", 6) == 0)
+        {
+            Grid::QUERY = QUERY_FIRST_K;
+            Grid::QUERY_K = atoi(argv[i] + 6);
+            if (Grid::QUERY_K < 1 || Grid::QUERY_K > MAX_QUERY_HITS)
+            {
+                printf("The hit number of first must be 1 to %d.\n", MAX_QUERY_HITS);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "kernel=", 7) == 0)
+        {
+            if (!SelectBlockKernel(argv[i] + 7))
+            {
+                printf("Kernel %s is not supported.\n", argv[i] + 7);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "out=", 4) == 0)
+        {
+            if (strcmp(argv[i] + 4, "text") == 0)
+                hitFormat = HIT_TEXT;
+            else if (strcmp(argv[i] + 4, "bin") == 0)
+                hitFormat = HIT_BINARY;
+            else if (strcmp(argv[i] + 4, "bin_ids") == 0)
+                hitFormat = HIT_BINARY_IDS;
+            else
+            {
+                printf("Unknown output format %s.\n", argv[i] + 4);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "stats=", 6) == 0)
+        {
+            statsFile = argv[i] + 6;
+            Grid::COLLECT_STATS = true;
+        }
+        else if (strcmp(argv[i], "perf") == 0)
+            countPerf = true;
+        else if (strcmp(argv[i], "grid") != 0)
+        {
+            printf("Unknown option %s.\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (useBvh && Grid::QUERY != QUERY_ALL)
+    {
+        printf("The closest, any and first hit queries need the grid.\n");
+        return -1;
+    }
+
+    if (streamRays && sortRays)
+    {
+        printf("The rays can't be sorted in the stream mode.\n");
+        return -1;
+    }
+
+    if (streamRays && isTextInput(argv[2]))
+    {
+        printf("The stream mode reads binary rays.\n");
+        return -1;
+    }
+
 	LARGE_INTEGER performanceCount;
     QueryPerformanceFrequency(&performanceCount);
     Scalar freqency = (Scalar)(performanceCount.QuadPart);
@@ -53,96 +167,143 @@ int main(int argc, char* argv[])
 	long long endCount;
 	long long totalCount = 0;
 
+	// Phase times, and the grid shape and traversal counters in stats mode.
+	StatsReport report;
+
+	// Hardware counters of the phases, over all the threads.
+	PerfCounters perf;
+	if (countPerf && !perf.Start())
+		printf("Hardware counters unavailable: %s.\n", perf.Error());
+
     const char* geomFile = argv[1];
 	const char* rayFile = argv[2];
 	const char* outputFile = argv[3];
 
-	FILE *fp1 = NULL;
-	fopen_s(&fp1, geomFile, "rb");
-	if (fp1 == NULL) {
+	// The inputs are mapped, the records are read in place. The stream mode reads
+	// the rays later, chunk by chunk.
+	MappedFile geomInput;
+	if (!geomInput.Open(geomFile)) {
 		printf("Can't open %s.\n", geomFile);
 		return -1;
 	}
-	FILE *fp2 = NULL;
-	fopen_s(&fp2, rayFile, "rb");
-	if (fp2 == NULL) {
+	MappedFile rayInput;
+	if (!streamRays && !rayInput.Open(rayFile)) {
 		printf("Can't open %s.\n", rayFile);
 		return -1;
 	}
 
-	unsigned int numOfTriangles;
-	unsigned int numOfRays;
-	BasicTriangle *basicTriangles;
-	BasicRay *basicRays;
-
-	// Read triangles
-	fread(&numOfTriangles, sizeof(numOfTriangles), 1, fp1);
-	basicTriangles = new BasicTriangle[numOfTriangles];
-	fread(basicTriangles, sizeof(BasicTriangle) ,numOfTriangles, fp1);
-	fclose(fp1);
+	// The .txt inputs are parsed into the layout of the binary records.
+	unsigned int numOfTriangles = 0;
+	unsigned int numOfRays = 0;
+	const BasicTriangle* basicTriangles = NULL;
+	const BasicRay* basicRays = NULL;
+	Scalar* geomValues = NULL;
+	Scalar* rayValues = NULL;
+	if (isTextInput(geomFile)) {
+		geomValues = readTextInput(geomInput, 3, numOfTriangles);
+		if (geomValues == NULL) {
+			printf("%s is not a geometry text file.\n", geomFile);
+			return -1;
+		}
+		basicTriangles = (const BasicTriangle*)geomValues;
+	}
+	else {
+		if (geomInput.Size() >= sizeof(numOfTriangles))
+			memcpy(&numOfTriangles, geomInput.Data(), sizeof(numOfTriangles));
+		if (geomInput.Size() < sizeof(numOfTriangles) + (size_t)numOfTriangles * sizeof(BasicTriangle)) {
+			printf("%s is truncated.\n", geomFile);
+			return -1;
+		}
+		basicTriangles = (const BasicTriangle*)(geomInput.Data() + sizeof(numOfTriangles));
+	}
+	// The stream mode leaves basicRays NULL, the rays are read in streamHits.
+	if (!streamRays && isTextInput(rayFile)) {
+		rayValues = readTextInput(rayInput, 2, numOfRays);
+		if (rayValues == NULL) {
+			printf("%s is not a ray text file.\n", rayFile);
+			delete[] geomValues;
+			return -1;
+		}
+		basicRays = (const BasicRay*)rayValues;
+	}
+	else if (!streamRays) {
+		if (rayInput.Size() >= sizeof(numOfRays))
+			memcpy(&numOfRays, rayInput.Data(), sizeof(numOfRays));
+		if (rayInput.Size() < sizeof(numOfRays) + (size_t)numOfRays * sizeof(BasicRay)) {
+			printf("%s is truncated.\n", rayFile);
+			delete[] geomValues;
+			return -1;
+		}
+		basicRays = (const BasicRay*)(rayInput.Data() + sizeof(numOfRays));
+	}
 
-	// Read rays
-	fread(&numOfRays, sizeof(numOfRays), 1, fp2);
-	basicRays = new BasicRay[numOfRays];
-	fread(basicRays, sizeof(BasicRay) ,numOfRays, fp2);
-	fclose(fp2);
+	// The rays are traced and counted in int, the stream mode reads them by chunk.
+	if (numOfRays > (unsigned int)INT_MAX) {
+		printf("%u rays, more than can be traced at once, use stream.\n", numOfRays);
+		delete[] geomValues;
+		delete[] rayValues;
+		return -1;
+	}
 
-    // allocate triangle memory
+    // allocate triangle and ray memory
     Triangle* triangles = new Triangle[numOfTriangles];
+    Ray* rays = new Ray[numOfRays];
 
-    // convert BasicTriangle to Triangle.
+	// One pass over the records fills the triangles with their boxes and the precomputed rays,
+	// and computes the bbox of the triangles.
+	Box triBoxAll;
 #if PARALLEL
-    tbb::parallel_for(tbb::blocked_range<int>(0,numOfTriangles),ParseTriangleTask(triangles,basicTriangles));
+	LoadTask loadTask(basicTriangles, numOfTriangles, triangles, basicRays, rays);
+	tbb::parallel_reduce(tbb::blocked_range<long long>(0, (long long)numOfTriangles + numOfRays), loadTask);
+#if TIGHT_BOX
+	triBoxAll = loadTask.mBox;
+#endif
 #else
     for (unsigned int i = 0; i < numOfTriangles; ++i)
     {
-		BasicTriangle& btri = basicTriangles[i];
+		const BasicTriangle& btri = basicTriangles[i];
 
 		triangles[i].p0 = btri.vertex[0];
 		triangles[i].p1 = btri.vertex[1];
 		triangles[i].p2 = btri.vertex[2];
-    }    
+		triangles[i].CalculateBox();
+#if TIGHT_BOX
+		triBoxAll.Extent(triangles[i].box);
 #endif
+    }
 
-    // allocate the ray memory
-    Ray* rays = new Ray[numOfRays];
-
-    // Convert BasicRay to ray
-#if PARALLEL
-    tbb::parallel_for(tbb::blocked_range<int>(0,numOfRays),ParseRayTask(rays,basicRays));
-#else
     for (unsigned int i = 0; i < numOfRays; ++i)
     {
-        BasicRay& bray = basicRays[i];
+        const BasicRay& bray = basicRays[i];
 
 		rays[i].origin = bray.original;
 		rays[i].direction = bray.direction;
+		rays[i].id = i;
+		rayPreCompute(rays[i]);
     }
 #endif
 
+#if !TIGHT_BOX
+	triBoxAll.MinCorner = F3d(-CONFINEMENT);
+	triBoxAll.MaxCorner = F3d(CONFINEMENT);
+#endif
+
+	// The triangles have their own copy, the rays stay mapped for the output.
+	geomInput.Close();
+	delete[] geomValues;
+
 	QueryPerformanceCounter(&performanceCount);
 	endCount = performanceCount.QuadPart;
 	cout << "read time: " << (Scalar)(endCount - startCount) / freqency << endl;
+	report.AddPhase("read", double(endCount - startCount) / freqency);
+	if (countPerf)
+		perf.EndPhase("read");
 	totalCount += endCount - startCount;
 	startCount = endCount;
 
-    // this is the container for all the output intersection points
-    // here we simply use std::vector as the container but you will
-    // need to change to a thread-safe container if your computing is
-    // multi-threaded.
-#if PARALLEL
-#if PARSE_INSIDE
-    TBB_List<char*> intersectPoints;
-    intersectPoints.reserve(1024*1024);
-    intersectPoints.clear();
-#else
-    TBB_List<F3d> intersectPoints;
-    intersectPoints.reserve(1024*1024);
-    intersectPoints.clear();
-#endif
-#else
-    List<F3d> intersectPoints;
-#endif
+    // this is the container for all the output hits, ordered by ray id.
+    // The threads collect their hits apart and place them at the end.
+    List<HitRecord> hitRecords;
 
     // now you can perform the computation of the intersection points
     // but please note that parallelism isn't the panacea. It cannot 
@@ -155,103 +316,142 @@ int main(int argc, char* argv[])
     // algorithsm you can start thinking about where to parallelize.
 
 
-	// Compute bbox of triangle.
-	Box triBoxAll;
-	for (unsigned int i = 0; i < numOfTriangles; ++i)
+	// Create grid or bvh.
+	Accelerator* scene;
+	if (useBvh)
 	{
-		triangles[i].CalculateBox();
-#if TIGHT_BOX
-		triBoxAll.Extent(triangles[i].box);
-#endif
+		Bvh* bvh = new Bvh;
+		bvh->Initialize(triangles, numOfTriangles, triBoxAll);
+		scene = bvh;
 	}
+	else
+	{
+		Grid* grid = new Grid;
+		grid->Initialize(triangles, numOfTriangles, triBoxAll);
+		scene = grid;
 
-#if !TIGHT_BOX
-	triBoxAll.MinCorner = F3d(-CONFINEMENT);
-	triBoxAll.MaxCorner = F3d(CONFINEMENT);
-#endif
-
-	// Create grid.
-	Grid grid;
-	grid.Initialize(triangles, numOfTriangles, triBoxAll);
+		cout << "intersect kernel: " << GetBlockKernelName() << endl;
 
-	// Precompute of Ray.	
-    for (unsigned int i = 0; i < numOfRays; ++i)
-	{
-		RayPreCompute(rays[i], grid);
+		if (Grid::EXACT_OVERLAP)
+		{
+			int references = grid->CellOffset[grid->CellTotalNumber];
+			cout << "removed references: " << grid->RemovedReferenceNumber << " of "
+				<< references + grid->RemovedReferenceNumber << endl;
+		}
 	}
 
 	QueryPerformanceCounter(&performanceCount);
 	endCount = performanceCount.QuadPart;
-	cout << "create grid time: " << (Scalar)(endCount - startCount) / freqency << endl;
+	cout << (useBvh ? "create bvh time: " : "create grid time: ") << (Scalar)(endCount - startCount) / freqency << endl;
+	report.AddPhase("build", double(endCount - startCount) / freqency);
+	if (countPerf)
+		perf.EndPhase("build");
 	totalCount += endCount - startCount;
 	startCount = endCount;
 
+	// Trace the rays entering the scene close together one after another.
+	if (sortRays)
+	{
+		rays = SortRays(rays, numOfRays, triBoxAll);
+
+		QueryPerformanceCounter(&performanceCount);
+		endCount = performanceCount.QuadPart;
+		cout << "sort rays time: " << (Scalar)(endCount - startCount) / freqency << endl;
+		report.AddPhase("sort", double(endCount - startCount) / freqency);
+		if (countPerf)
+			perf.EndPhase("sort");
+		totalCount += endCount - startCount;
+		startCount = endCount;
+	}
+
 #if PARALLEL
 	tbb::task_scheduler_init init;
-	tbb::parallel_for(tbb::blocked_range<int>(0, numOfRays), RayParallel(rays, &grid, intersectPoints), tbb::auto_partitioner());
+#endif
+
+	// The stream mode traces and writes the rays chunk by chunk, and then it is done.
+	if (streamRays)
+	{
+		bool streamed = streamHits(rayFile, scene, outputFile, hitFormat, numOfRays);
+		if (statsFile != NULL && !useBvh)
+			((Grid*)scene)->FillStatsReport(report);
+		delete scene;
+		delete[] rays;
+		delete[] triangles;
+		if (!streamed)
+			return -1;
+
+		QueryPerformanceCounter(&performanceCount);
+		endCount = performanceCount.QuadPart;
+		cout << "intersect and write time: " << (Scalar)(endCount - startCount) / freqency << endl;
+		report.AddPhase("intersect and write", double(endCount - startCount) / freqency);
+		if (countPerf)
+			perf.EndPhase("intersect and write");
+		totalCount += endCount - startCount;
+		cout << "total: " << (Scalar)(totalCount) / freqency << endl;
+		report.AddPhase("total", double(totalCount) / freqency);
+		if (countPerf)
+			reportCounters(perf.Phases(), numOfRays, report);
+
+		if (statsFile != NULL && !report.Write(statsFile))
+		{
+			printf("Can't write %s.\n", statsFile);
+			return -1;
+		}
+
+		return 0;
+	}
+
+#if PARALLEL
+	size_t arenaBytes = computeIntersectionsParallel(scene, numOfRays, rays, hitRecords);
 #else
-	computeIntersections(grid, numOfRays, rays, intersectPoints);
+	size_t arenaBytes = computeIntersections(*scene, numOfRays, rays, hitRecords);
 #endif
 
 	QueryPerformanceCounter(&performanceCount);
 	endCount = performanceCount.QuadPart;
 	cout << "intersect time: " << (Scalar)(endCount - startCount) / freqency << endl;
+	report.AddPhase("intersect", double(endCount - startCount) / freqency);
+	if (countPerf)
+		perf.EndPhase("intersect");
 	totalCount += endCount - startCount;
 	startCount = endCount;
+	cout << "hit arena peak: " << arenaBytes / 1024 << " KB" << endl;
 
-    // now computation finishes. All the intersection points are now in the container intersectPoints.
+    // now computation finishes. All the hits are now in the container hitRecords.
     // before we output results, we first delete the input data that we no longer use
+	if (statsFile != NULL && !useBvh)
+		((Grid*)scene)->FillStatsReport(report);
+	delete scene;
 	delete[] rays;
 	delete[] triangles;	
 
-    FILE* file;
-    fopen_s( &file,outputFile,"wb");
-
-    // we now output the results into the specified file
-    long nBytes = long(intersectPoints.size());
-    // can the length of the buffer exceed 128?
-    char buf[128];
-    sprintf_s(buf,128,"%d\r\n",nBytes);
-    string s(buf);
-
-#if PARALLEL
-#if PARSE_INSIDE
-    TBB_List< char* >::iterator itEnd = intersectPoints.end();
-    TBB_List< char* >::iterator it;
-#else
-    TBB_List<F3d>::iterator itEnd = intersectPoints.end();
-    TBB_List<F3d>::iterator it;
-#endif
-#else
-    List<F3d>::iterator itEnd = intersectPoints.end();
-    List<F3d>::iterator it;
-#endif
-    for(it = intersectPoints.begin() ;it != itEnd; ++it )
+    // we now output the results into the specified file, the hit points come from
+    // the input rays, the records refer to them by id.
+    bool written = writeHits(outputFile, hitRecords, basicRays, hitFormat);
+    delete[] rayValues;
+    if (!written)
     {
-#if PARSE_INSIDE
-        char* pStr = (*it);
-        s += pStr;
-        delete[] pStr;
-#else
-        F3d& intPt = *it;
-#if CUSTOM_OUT
-        vertex2str_g(&intPt.x, buf);
-#else
-        sprintf_s( buf, 128, "%g %g %g\r\n", intPt.x,intPt.y,intPt.z );
-#endif
-        s += buf;
-#endif
+        printf("Can't write %s.\n", outputFile);
+        return -1;
     }
 
-    fwrite(s.c_str(),s.length(), 1, file);
-
-    fclose(file);
-
 	QueryPerformanceCounter(&performanceCount);
 	endCount = performanceCount.QuadPart;
 	cout << "write time: " << (Scalar)(endCount - startCount) / freqency << endl;
+	report.AddPhase("write", double(endCount - startCount) / freqency);
+	if (countPerf)
+		perf.EndPhase("write");
 	totalCount += endCount - startCount;
 	cout << "total: " << (Scalar)(totalCount) / freqency << endl;
+	report.AddPhase("total", double(totalCount) / freqency);
+	if (countPerf)
+		reportCounters(perf.Phases(), numOfRays, report);
+
+	if (statsFile != NULL && !report.Write(statsFile))
+	{
+		printf("Can't write %s.\n", statsFile);
+		return -1;
+	}
 
     // congratulations!!!
     // your program finished the intensive computation 
@@ -260,21 +460,65 @@ int main(int argc, char* argv[])
 	return 0;
 }
 
-#if !PARALLEL
-void computeIntersections(Grid& grid, int numOfRays, Ray* rays, List<F3d>& intersectPoints)
+#if PARALLEL
+// The hits of the ray i go to hitRecords from offset[i] to offset[i + 1], sorted along the ray,
+// whatever thread found them. So the output is the same for every run and thread count.
+// Returns the peak bytes of the thread arenas, they are released at the end.
+size_t computeIntersectionsParallel(Accelerator* scene, int numOfRays, Ray* rays, List<HitRecord>& hitRecords)
+{
+	// Trace, every thread fills its own list and counts the hits per ray.
+	int* hitCounts = new int[numOfRays];
+	memset(hitCounts, 0, sizeof(int) * numOfRays);
+	tbb::enumerable_thread_specific<HitList> localHits;
+	tbb::parallel_for(tbb::blocked_range<int>(0, numOfRays), RayParallel(rays, scene, localHits, hitCounts), tbb::auto_partitioner());
+
+	// Offsets of the hits of each ray, in 64 bits as the total may pass INT_MAX.
+	long long* offset = new long long[numOfRays + 1];
+	offset[0] = 0;
+	ScanHitTask scanTask(hitCounts, offset);
+	tbb::parallel_scan(tbb::blocked_range<int>(0, numOfRays), scanTask);
+	delete[] hitCounts;
+
+	// Place the hits, then sort them per ray.
+	List<HitList*> lists;
+	for (tbb::enumerable_thread_specific<HitList>::iterator it = localHits.begin(); it != localHits.end(); ++it)
+		lists.push_back(&(*it));
+
+	hitRecords.resize(offset[numOfRays]);
+	if (!hitRecords.empty())
+	{
+		long long* cursors = new long long[numOfRays];
+		memcpy(cursors, offset, sizeof(long long) * numOfRays);
+		tbb::parallel_for(tbb::blocked_range<int>(0, int(lists.size()), 1), PlaceHitTask(&lists[0], cursors, &hitRecords[0]));
+		delete[] cursors;
+
+		tbb::parallel_for(tbb::blocked_range<int>(0, numOfRays), SortHitTask(offset, &hitRecords[0]));
+	}
+
+	delete[] offset;
+
+	size_t arenaBytes = 0;
+	for (size_t i = 0; i < lists.size(); ++i)
+		arenaBytes += lists[i]->capacity_bytes();
+
+	return arenaBytes;
+}
+#else
+size_t computeIntersections(Accelerator& scene, int numOfRays, Ray* rays, List<HitRecord>& hitRecords)
 {
 #if MORE_OUTPUT 
 	ofstream out;
 	out.open("out_more.txt");
 	int oldNumber = 0;
 #endif
+	HitList hits;
 	for (int i = 0; i < numOfRays; ++i)
 	{
-		grid.IntersectRay(rays[i], intersectPoints);
+		scene.IntersectRay(rays[i], hits);
 
 #if MORE_OUTPUT
-		int intNumber = intersectPoints.size() - oldNumber;
-		oldNumber = intersectPoints.size();
+		int intNumber = hits.size() - oldNumber;
+		oldNumber = hits.size();
 		if (intNumber > 0)
 		{
 			out << i << " : " << intNumber << endl;
@@ -285,115 +529,384 @@ void computeIntersections(Grid& grid, int numOfRays, Ray* rays, List<F3d>& inter
 #if MORE_OUTPUT
 	out.close();
 #endif
+
+	// Same order as the parallel version, by ray id then along the ray.
+	long long* offset = new long long[numOfRays + 1];
+	memset(offset, 0, sizeof(long long) * (numOfRays + 1));
+	for (size_t i = 0; i < hits.size(); ++i)
+		++offset[hits[i].rayId + 1];
+	for (int i = 0; i < numOfRays; ++i)
+		offset[i + 1] += offset[i];
+
+	hitRecords.resize(hits.size());
+	long long* cursors = new long long[numOfRays];
+	memcpy(cursors, offset, sizeof(long long) * numOfRays);
+	for (size_t i = 0; i < hits.size(); ++i)
+		hitRecords[cursors[hits[i].rayId]++] = hits[i];
+	delete[] cursors;
+
+	for (int i = 0; i < numOfRays; ++i)
+		std::sort(hitRecords.begin() + offset[i], hitRecords.begin() + offset[i + 1]);
+	delete[] offset;
+
+	return hits.capacity_bytes();
 }
 #endif
 
-void RayPreCompute(Ray& ray, const Grid& grid)
+// Hits per formatted chunk, and chunks formatted at a time to bound the buffer memory.
+const int CHUNK_HITS = 4096;
+const int WAVE_CHUNKS = 64;
+
+// Write the hit count, then the point of every hit, as text or binary records. The chunks of
+// a wave are formatted in parallel into their own buffers, and each one is written at its
+// offset in the file, so no single string of the whole output is built.
+bool writeHits(const char* outputFile, const List<HitRecord>& hitRecords, const BasicRay* rays, HitFormat format)
 {
-	// x-direction.
-	if (fabs(ray.direction.x) < EPSILON)
-	{
-		ray.sign[0] = 0;
+	// The count of the output is 32 bits, as in stream mode.
+	long long num = (long long)hitRecords.size();
+	if (num > (long long)UINT_MAX) {
+		printf("%lld hits, more than the hit count of the output can hold.\n", num);
+		return false;
 	}
-	else
+
+	OutputFile file;
+	if (!file.Open(outputFile))
+		return false;
+
+	char header[BUFSIZE];
+	int headerLength = FormatHitHeader((unsigned int)num, format, header);
+	bool written = file.WriteAt(header, headerLength, 0);
+	long long offset = headerLength;
+
+	char* buffers[WAVE_CHUNKS];
+	int lengths[WAVE_CHUNKS];
+	long long offsets[WAVE_CHUNKS];
+	bool chunkWritten[WAVE_CHUNKS];
+	for (int i = 0; i < WAVE_CHUNKS; ++i)
+		buffers[i] = NULL;
+
+	int chunkNumber = int((num + CHUNK_HITS - 1) / CHUNK_HITS);
+	for (int wave = 0; wave < chunkNumber && written; wave += WAVE_CHUNKS)
 	{
-		ray.invDirection.x = 1.0f / ray.direction.x;
-		if (ray.direction.x > 0)
+		int count = (chunkNumber - wave < WAVE_CHUNKS) ? chunkNumber - wave : WAVE_CHUNKS;
+		for (int i = 0; i < count; ++i)
 		{
-			ray.sign[0] = 1;
-			ray.dt[0] = grid.CellSize.x * ray.invDirection.x;
+			if (buffers[i] == NULL)
+				buffers[i] = new char[CHUNK_HITS * MAX_HIT_LINE];
 		}
-		else
+
+#if PARALLEL
+		tbb::parallel_for(tbb::blocked_range<int>(0, count, 1),
+			FormatChunkTask(&hitRecords[0], num, (long long)wave * CHUNK_HITS, CHUNK_HITS, rays, format, buffers, lengths));
+#else
+		for (int i = 0; i < count; ++i)
 		{
-			ray.sign[0] = -1;
-			ray.dt[0] = -grid.CellSize.x * ray.invDirection.x;
+			long long begin = (long long)(wave + i) * CHUNK_HITS;
+			lengths[i] = FormatHits(&hitRecords[begin], (num - begin < CHUNK_HITS) ? int(num - begin) : CHUNK_HITS, rays, 0, format, buffers[i]);
 		}
+#endif
+
+		for (int i = 0; i < count; ++i)
+		{
+			offsets[i] = offset;
+			offset += lengths[i];
+		}
+
+#if PARALLEL
+		tbb::parallel_for(tbb::blocked_range<int>(0, count, 1),
+			WriteChunkTask(file, buffers, lengths, offsets, chunkWritten));
+#else
+		for (int i = 0; i < count; ++i)
+			chunkWritten[i] = file.WriteAt(buffers[i], lengths[i], offsets[i]);
+#endif
+
+		for (int i = 0; i < count; ++i)
+			written = written && chunkWritten[i];
+	}
+
+	for (int i = 0; i < WAVE_CHUNKS; ++i)
+		delete[] buffers[i];
+
+	file.Close();
+
+	return written;
+}
+
+// Stream mode: the rays are read, traced and written by chunks, a few chunks at a time, so
+// the memory does not grow with the ray number. The output is the same as the one of writeHits.
+// The text starts with the hit count, so the lines go to a temporary file and are copied
+// after the count at the end.
+bool streamHits(const char* rayFile, const Accelerator* scene, const char* outputFile, HitFormat format, unsigned int& numOfRays)
+{
+	FILE *input = NULL;
+	fopen_s(&input, rayFile, "rb");
+	if (input == NULL) {
+		printf("Can't open %s.\n", rayFile);
+		return false;
+	}
+
+	numOfRays = 0;
+	if (fread(&numOfRays, sizeof(numOfRays), 1, input) != 1) {
+		printf("%s is truncated.\n", rayFile);
+		fclose(input);
+		return false;
+	}
+
+	string linesFile = string(outputFile) + ".lines";
+	const char* bodyFile = (format == HIT_TEXT) ? linesFile.c_str() : outputFile;
+	long long bodyOffset = (format == HIT_TEXT) ? 0 : sizeof(unsigned int);
+	OutputFile body;
+	if (!body.Open(bodyFile)) {
+		printf("Can't write %s.\n", bodyFile);
+		fclose(input);
+		return false;
 	}
 
-	// y-direction.
-	if (fabs(ray.direction.y) < EPSILON)
+	bool read = true;
+	bool written = true;
+	long long hitNumber = 0;
+#if PARALLEL
+	int chunkNumber = 2 * tbb::task_scheduler_init::default_num_threads();
+	RayChunk* chunks = new RayChunk[chunkNumber];
+
+	ReadChunkFilter readFilter(input, numOfRays, chunks, chunkNumber);
+	TraceChunkFilter traceFilter(scene, format);
+	WriteChunkFilter writeFilter(body, bodyOffset);
+
+	tbb::pipeline pipeline;
+	pipeline.add_filter(readFilter);
+	pipeline.add_filter(traceFilter);
+	pipeline.add_filter(writeFilter);
+	pipeline.run(chunkNumber);
+	pipeline.clear();
+
+	read = !readFilter.Failed();
+	written = writeFilter.Written();
+	hitNumber = writeFilter.HitNumber();
+#else
+	RayChunk* chunks = new RayChunk[1];
+	RayChunk& chunk = chunks[0];
+	for (long long first = 0; first < numOfRays && read && written; first += STREAM_CHUNK_RAYS)
+	{
+		int num = (numOfRays - first < STREAM_CHUNK_RAYS) ? int(numOfRays - first) : STREAM_CHUNK_RAYS;
+		read = ReadRayChunk(input, first, num, chunk);
+		if (!read)
+			break;
+
+		TraceRayChunk(*scene, format, chunk);
+		if (chunk.length > 0)
+			written = body.WriteAt(&chunk.output[0], chunk.length, bodyOffset);
+		bodyOffset += chunk.length;
+		hitNumber += chunk.hitRecords.size();
+	}
+#endif
+	delete[] chunks;
+	fclose(input);
+
+	// The count of the output is 32 bits, the output is not finished if it can't hold it.
+	bool counted = (hitNumber <= (long long)UINT_MAX);
+	written = written && counted;
+
+	char header[BUFSIZE];
+	int headerLength = FormatHitHeader((unsigned int)hitNumber, format, header);
+	if (format != HIT_TEXT)
 	{
-		ray.sign[1] = 0;
+		written = written && body.WriteAt(header, headerLength, 0);
+		body.Close();
 	}
 	else
 	{
-		ray.invDirection.y = 1.0f / ray.direction.y;
-		if (ray.direction.y > 0)
+		body.Close();
+
+		// Copy the lines after the count.
+		OutputFile file;
+		FILE *lines = NULL;
+		if (written && file.Open(outputFile))
 		{
-			ray.sign[1] = 1;
-			ray.dt[1] = grid.CellSize.y * ray.invDirection.y;
+			fopen_s(&lines, bodyFile, "rb");
+			written = (lines != NULL) && file.WriteAt(header, headerLength, 0);
+
+			const int COPY_SIZE = 1 << 20;
+			char* buffer = new char[COPY_SIZE];
+			long long offset = headerLength;
+			size_t size;
+			while (written && (size = fread(buffer, 1, COPY_SIZE, lines)) > 0)
+			{
+				written = file.WriteAt(buffer, size, offset);
+				offset += size;
+			}
+			delete[] buffer;
+
+			if (lines != NULL)
+				fclose(lines);
+			file.Close();
 		}
 		else
 		{
-			ray.sign[1] = -1;
-			ray.dt[1] = -grid.CellSize.y * ray.invDirection.y;
+			written = false;
 		}
+		remove(bodyFile);
+	}
+
+	if (!read) {
+		printf("%s is truncated.\n", rayFile);
+		return false;
+	}
+	if (!counted) {
+		printf("%lld hits, more than the hit count of the output can hold.\n", hitNumber);
+		return false;
 	}
+	if (!written) {
+		printf("Can't write %s.\n", outputFile);
+		return false;
+	}
+
+	return true;
+}
 
-	// z-direction.
-	if (fabs(ray.direction.z) < EPSILON)
+// Reorder the rays by rayOrderKey, the rays keep their input index in id.
+// The returned array replaces rays, which is deleted.
+Ray* SortRays(Ray* rays, int numOfRays, const Box& box)
+{
+	unsigned int* keys = new unsigned int[numOfRays];
+#if PARALLEL
+	tbb::parallel_for(tbb::blocked_range<int>(0, numOfRays), RayKeyTask(rays, box, keys));
+#else
+	for (int i = 0; i < numOfRays; ++i)
+		keys[i] = rayOrderKey(rays[i], box);
+#endif
+
+	int* order = new int[numOfRays];
+	RadixSortOrder(keys, numOfRays, order);
+	delete[] keys;
+
+	Ray* sortedRays = new Ray[numOfRays];
+#if PARALLEL
+	tbb::parallel_for(tbb::blocked_range<int>(0, numOfRays), GatherRayTask(rays, order, sortedRays));
+#else
+	for (int i = 0; i < numOfRays; ++i)
+		sortedRays[i] = rays[order[i]];
+#endif
+
+	delete[] order;
+	delete[] rays;
+
+	return sortedRays;
+}
+
+// Print the hardware counts of the phases, with the instructions per cycle and
+// the misses per ray, and put them in the report.
+void reportCounters(const List<PhaseCounters>& phases, long long rays, StatsReport& report)
+{
+	report.Counters = phases;
+	report.RayNumber = rays;
+
+	for (size_t i = 0; i < phases.size(); ++i)
 	{
-		ray.sign[2] = 0;
+		const long long* counts = phases[i].counts;
+		if (counts[PERF_CYCLES] < 0 && counts[PERF_INSTRUCTIONS] < 0 && counts[PERF_LLC_MISSES] < 0 && counts[PERF_BRANCH_MISSES] < 0)
+			continue;
+
+		cout << phases[i].name << " counters:";
+		if (counts[PERF_CYCLES] >= 0)
+			cout << " cycles " << counts[PERF_CYCLES];
+		if (counts[PERF_INSTRUCTIONS] >= 0)
+			cout << " instructions " << counts[PERF_INSTRUCTIONS];
+		if (counts[PERF_CYCLES] > 0 && counts[PERF_INSTRUCTIONS] >= 0)
+			cout << " IPC " << double(counts[PERF_INSTRUCTIONS]) / counts[PERF_CYCLES];
+		if (counts[PERF_LLC_MISSES] >= 0 && rays > 0)
+			cout << " LLC misses/ray " << double(counts[PERF_LLC_MISSES]) / rays;
+		if (counts[PERF_BRANCH_MISSES] >= 0 && rays > 0)
+			cout << " branch misses/ray " << double(counts[PERF_BRANCH_MISSES]) / rays;
+		cout << endl;
 	}
-	else
+}
+
+bool isTextInput(const char* filename)
+{
+	size_t length = strlen(filename);
+	return length >= 4 && strcmp(filename + length - 4, ".txt") == 0;
+}
+
+// Text input: the record count on the first line, then linesPerRecord lines of three numbers
+// per record. The text is cut into chunks at line ends, the lines of each chunk are counted,
+// and the chunks are parsed in parallel, each one at the values of its first line.
+// Returns the values, NULL if the text doesn't hold count records.
+Scalar* readTextInput(const MappedFile& input, int linesPerRecord, unsigned int& count)
+{
+	const char* begin = input.Data();
+	const char* end = begin + input.Size();
+
+	// The count line.
+	const char* lineEnd = FindNewline(begin, end);
+	if (lineEnd == end)
+		return NULL;
+	char header[BUFSIZE];
+	size_t headerLength = lineEnd - begin;
+	if (headerLength >= BUFSIZE)
+		return NULL;
+	memcpy(header, begin, headerLength);
+	header[headerLength] = '\0';
+	count = (unsigned int)strtoul(header, NULL, 10);
+
+	// Chunks of about TEXT_CHUNK_SIZE bytes.
+	List<const char*> bounds;
+	bounds.push_back(lineEnd + 1);
+	while (bounds.back() < end)
 	{
-		ray.invDirection.z = 1.0f / ray.direction.z;
-		if (ray.direction.z > 0)
-		{
-			ray.sign[2] = 1;
-			ray.dt[2] = grid.CellSize.z * ray.invDirection.z;
-		}
+		const char* p = bounds.back() + TEXT_CHUNK_SIZE;
+		if (p >= end)
+			p = end;
 		else
 		{
-			ray.sign[2] = -1;
-			ray.dt[2] = -grid.CellSize.z * ray.invDirection.z;
+			p = FindNewline(p, end);
+			if (p < end)
+				++p;
 		}
+		bounds.push_back(p);
 	}
-}
+	int chunkNumber = int(bounds.size()) - 1;
 
-void* FileRead(const char* filename, int interval, std::vector<char*>& outList, unsigned int& numberOfGeom)
-{
-    // query the size of the file
-    struct _stat fInfo;
-    _stat(filename, &fInfo);
-    long buffersize = fInfo.st_size;
-    char* pBuffer = new char[buffersize];
-
-    // read all data into one buffer
-    DWORD nNumberOfBytesRead;
-    HANDLE hFile = CreateFile(filename, GENERIC_READ,0,NULL,OPEN_EXISTING,NULL,NULL);
-    ReadFile(hFile,pBuffer,buffersize,&nNumberOfBytesRead,NULL);
-    CloseHandle(hFile);
-
-    //first get the first line to get the number of geom
-    int i = 0;
-    while(pBuffer[i]!='\n') {i++;}
-    pBuffer[i] = '\0';
-    numberOfGeom = atoi(pBuffer);
-
-    // then get the points
-    char* token = &pBuffer[i+1];
-    char* pStart = token;
-
-    // parse the points
-    i = 0;
-    int n = 0;
-    int tempResult = interval - 1;
-    while (token[i]!='\0')
-    {
-        if(token[i]=='\n')
-        {
-            if(n%interval == tempResult)
-            {
-                outList.push_back(pStart);
-                pStart = &token[i+1];
-                token[i] = '\0';
-            }
-            n++;
-        }
-        i++;
-    }
+	// The values of chunk i start at firstValue[i].
+	List<int> firstValue;
+	firstValue.resize(chunkNumber + 1);
+	firstValue[0] = 0;
+	if (chunkNumber > 0)
+	{
+#if PARALLEL
+		tbb::parallel_for(tbb::blocked_range<int>(0, chunkNumber), CountLineTask(&bounds[0], &firstValue[1]));
+#else
+		for (int i = 0; i < chunkNumber; ++i)
+			firstValue[i + 1] = CountTextLines(bounds[i], bounds[i + 1]);
+#endif
+	}
+	for (int i = 0; i < chunkNumber; ++i)
+		firstValue[i + 1] = firstValue[i] + 3 * firstValue[i + 1];
+
+	if ((long long)firstValue[chunkNumber] != 3LL * linesPerRecord * count)
+		return NULL;
+
+	Scalar* values = new Scalar[firstValue[chunkNumber]];
+	bool* parsed = new bool[chunkNumber + 1];
+	if (chunkNumber > 0)
+	{
+#if PARALLEL
+		tbb::parallel_for(tbb::blocked_range<int>(0, chunkNumber), ParseLineTask(&bounds[0], &firstValue[0], values, parsed));
+#else
+		for (int i = 0; i < chunkNumber; ++i)
+			parsed[i] = (ParseTextLines(bounds[i], bounds[i + 1], values + firstValue[i]) == firstValue[i + 1] - firstValue[i]);
+#endif
+	}
+
+	bool allParsed = true;
+	for (int i = 0; i < chunkNumber; ++i)
+		allParsed = allParsed && parsed[i];
+	delete[] parsed;
+	if (!allParsed)
+	{
+		delete[] values;
+		return NULL;
+	}
 
-    // to clean
-    return pBuffer;
+	return values;
 }
\ No newline at end of file